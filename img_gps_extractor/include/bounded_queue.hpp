@@ -0,0 +1,88 @@
+/*
+ * Bounded queue
+ *
+ * Connects the stages of the conversion pipeline: producers wait when it is
+ * full, so a fast stage can only run a few items ahead of the next one, and
+ * consumers wait until there is an item or the queue is closed.
+ *
+ */
+
+#ifndef _BOUNDED_QUEUE_H_
+#define _BOUNDED_QUEUE_H_
+
+// basic stuff
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <stddef.h>
+
+namespace pipeline
+{
+
+  template<class T>
+  class bounded_queue
+  {
+    public:
+      bounded_queue(size_t capacity):_capacity(capacity),_closed(false){}
+
+      // waits for room. False if the queue was closed (the item is dropped).
+      bool push(const T& item)
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while(_items.size() >= _capacity && !_closed)
+          _not_full.wait(lock);
+        if(_closed)
+          return false;
+        _items.push_back(item);
+        _not_empty.notify_one();
+        return true;
+      }
+
+      // waits for an item. False once the queue is closed and empty.
+      bool pop(T& item)
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while(_items.empty() && !_closed)
+          _not_empty.wait(lock);
+        if(_items.empty())
+          return false;
+        item = _items.front();
+        _items.pop_front();
+        _not_full.notify_one();
+        return true;
+      }
+
+      // an item if there is one right now, without waiting
+      bool try_pop(T& item)
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_items.empty())
+          return false;
+        item = _items.front();
+        _items.pop_front();
+        _not_full.notify_one();
+        return true;
+      }
+
+      // no more items: pushes fail and pops drain what is left. Used by the
+      // producer when it is done, and by either side to stop the other one.
+      void close()
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        _not_full.notify_all();
+        _not_empty.notify_all();
+      }
+
+    private:
+      std::deque<T> _items;
+      size_t _capacity;
+      bool _closed;
+      std::mutex _mutex;
+      std::condition_variable _not_full;
+      std::condition_variable _not_empty;
+  };
+
+}
+
+#endif // _BOUNDED_QUEUE_H_
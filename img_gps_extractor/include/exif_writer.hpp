@@ -0,0 +1,40 @@
+/*
+ * Exif writer
+ *
+ * Builds the APP1 Exif segment with the GPS position, speed and capture time
+ * of an image, and puts it in the encoded jpeg before it goes to disk, so
+ * the images come out geotagged without rewriting them afterwards.
+ *
+ */
+
+#ifndef _EXIF_WRITER_H_
+#define _EXIF_WRITER_H_
+
+// basic stuff
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace exif_writer
+{
+
+  typedef struct
+  {
+    bool has_position; // lat, lon, alt and speed are set
+    double lat, lon; // deg (WGS-84)
+    double alt; // m
+    double speed; // ground speed in m/s
+    double utc; // capture time, seconds since the epoch (<0 if unknown)
+  }gps_tags_t;
+
+  // APP1 segment (marker and length included). Empty if there is nothing to
+  // write.
+  std::string app1_segment(const gps_tags_t& tags);
+
+  // inserts the segment in an encoded jpeg, right after SOI and the JFIF
+  // APP0 if there is one. False if the data is not a jpeg.
+  bool insert_app1(std::vector<unsigned char>& jpeg, const std::string& segment);
+
+}
+
+#endif // _EXIF_WRITER_H_
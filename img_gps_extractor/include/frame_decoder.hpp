@@ -0,0 +1,172 @@
+/*
+ * Frame decoders
+ *
+ * Backends that decode the frame of an mp4 closest to a timestamp: one on
+ * top of cv::VideoCapture, and (when built WITH_LIBAV) one straight on
+ * libavformat/libavcodec, with threaded decoding, which also reads the
+ * GPMF payloads through its demuxer. Both resolve timestamps to exact frames
+ * with the sample table of the video track.
+ *
+ */
+
+#ifndef _FRAME_DECODER_H_
+#define _FRAME_DECODER_H_
+
+// opencv stuff to get images
+#include "opencv2/opencv.hpp"
+
+// basic stuff
+#include <string>
+#include <iostream>
+#include <stdint.h>
+#include "common.hpp"
+
+// exact frame timestamps and keyframes
+#include "frame_index.hpp"
+
+// gpmf payloads from the open file
+#include "gpmf_source.hpp"
+#include <vector>
+#include <mutex>
+
+#ifdef WITH_LIBAV
+struct AVFormatContext;
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+struct SwsContext;
+#endif
+
+namespace mp4_img_extractor
+{
+
+  typedef enum
+  {
+    EXTR_OK=0,
+    EXTR_SKIPPING_FRAME,
+    EXTR_ERROR,
+    EXTR_CANT_LOAD_VIDEO,
+    EXTR_CANT_FRAME_OUT_OF_BOUNDS,
+  }EXTR_RET;
+
+  typedef enum
+  {
+    BACKEND_OPENCV=0,
+    BACKEND_LIBAV,
+  }BACKEND;
+
+  // opencv. libav (when it was built in) is only used with --backend libav
+  // until it has been checked against opencv on real videos.
+  const BACKEND DEFAULT_BACKEND = BACKEND_OPENCV;
+
+  // backend from its name ("opencv" or "libav"). False if unknown.
+  bool parse_backend(const std::string& name, BACKEND& backend);
+
+  // if the backend was compiled in
+  bool backend_available(BACKEND backend);
+
+  class frame_decoder
+  {
+    public:
+      frame_decoder(bool verbose):_duration(0),_fps(0),_verbose(verbose),_index(verbose){}
+      virtual ~frame_decoder(){}
+      virtual int32_t open(const std::string& in) = 0;
+      virtual void close() = 0;
+      // decodes the frame shown closest to ts (seconds) and its exact
+      // timestamp. Cheapest when called with increasing timestamps.
+      virtual int32_t read(float ts, cv::Mat& frame, float& real_ts) = 0;
+      // frame read() decodes for ts (-1 if the video has no index)
+      int64_t frame_at(float ts){ return _index.frames() ? _index.frame_at(ts) : -1; }
+      // the GPMF track of the open video, if this decoder demuxes it (NULL
+      // if not, it is read from the file on its own then)
+      virtual gpmf_source::source* gpmf(){ return NULL; }
+      float duration(){ return _duration; } // seconds
+      float fps(){ return _fps; }
+
+    protected:
+      float _duration;
+      float _fps;
+      bool _verbose;
+      frame_index _index; // of the open video
+  };
+
+  // NULL if the backend was not compiled in
+  frame_decoder* create_decoder(BACKEND backend, bool verbose);
+
+  class cv_decoder : public frame_decoder
+  {
+    public:
+      cv_decoder(bool verbose);
+      int32_t open(const std::string& in);
+      void close();
+      int32_t read(float ts, cv::Mat& frame, float& real_ts);
+
+    private:
+      cv::VideoCapture _cap;
+      int64_t _next_frame; // frame the capture will decode next (-1 if unknown)
+
+      int32_t read_by_time(float ts, cv::Mat& frame, float& real_ts); // without an index
+  };
+
+#ifdef WITH_LIBAV
+  // the GPMF track of the file an av_decoder has open: payload positions
+  // from the index libavformat built when it opened the file, and the bytes
+  // read through its io, taking turns with the demuxer
+  class av_gpmf_source : public gpmf_source::source
+  {
+    public:
+      av_gpmf_source(std::mutex& io, bool verbose);
+      bool load(AVFormatContext *fmt); // false if the file has no gpmd track
+      void clear();
+      uint32_t payloads();
+      uint32_t payload_size(uint32_t index);
+      std::shared_ptr<uint32_t> payload(uint32_t index, uint32_t& size);
+
+    private:
+      typedef struct
+      {
+        int64_t pos; // in the file
+        uint32_t size;
+      }payload_t;
+
+      AVFormatContext *_fmt;
+      std::mutex& _io;
+      bool _verbose;
+      std::vector<payload_t> _payloads;
+  };
+
+  class av_decoder : public frame_decoder
+  {
+    public:
+      av_decoder(bool verbose);
+      ~av_decoder();
+      int32_t open(const std::string& in);
+      void close();
+      int32_t read(float ts, cv::Mat& frame, float& real_ts);
+      gpmf_source::source* gpmf();
+
+    private:
+      AVFormatContext *_fmt;
+      AVCodecContext *_codec;
+      AVFrame *_frame; // last decoded frame
+      AVFrame *_next; // frame being received
+      AVPacket *_pkt;
+      SwsContext *_sws; // to bgr
+      int _stream; // video stream index
+      double _time_base; // seconds per pts tick
+      int64_t _start_pts; // pts of the start of the video
+      int64_t _frame_pts; // pts of _frame (AV_NOPTS_VALUE if none)
+      int64_t _frame_num; // index frame of _frame (-1 if none)
+      int64_t _frame_ticks; // pts ticks per frame
+      bool _draining; // no more packets, flushing the decoder
+      std::mutex _io; // file reads, by the demuxer and the gpmf source
+      av_gpmf_source _gpmf;
+      bool _has_gpmf;
+
+      int32_t decode_next(); // decodes the next frame into _frame
+  };
+#endif
+
+}
+
+#endif // _FRAME_DECODER_H_
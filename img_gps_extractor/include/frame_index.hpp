@@ -0,0 +1,47 @@
+/*
+ * Frame index
+ *
+ * Exact timestamps of the frames of an mp4, read once from the sample table
+ * of its video track (stts/ctts/stss, shifted by the edit list), with the
+ * keyframe each frame has to be decoded from. Decoders use it to resolve a
+ * timestamp to a frame before decoding, instead of seeking and asking where
+ * they landed.
+ *
+ */
+
+#ifndef _FRAME_INDEX_H_
+#define _FRAME_INDEX_H_
+
+// basic stuff
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include "common.hpp"
+
+namespace mp4_img_extractor
+{
+
+  class frame_index
+  {
+    public:
+      frame_index(bool verbose=false);
+      int32_t load(const std::string& in); // EXTR_OK, EXTR_CANT_LOAD_VIDEO if no sample table
+      void clear();
+      // frames are numbered in presentation order
+      size_t frames() const { return _pts.size(); }
+      double pts(size_t frame) const { return _pts[frame]; } // seconds
+      size_t keyframe(size_t frame) const { return _key[frame]; } // last keyframe at or before frame
+      size_t frame_at(double ts) const; // frame shown closest to ts
+      double duration() const { return _duration; } // seconds
+
+    private:
+      bool _verbose;
+      std::vector<double> _pts;
+      std::vector<uint32_t> _key;
+      double _duration;
+  };
+
+}
+
+#endif // _FRAME_INDEX_H_
@@ -0,0 +1,47 @@
+/*
+ * GPMF scaling kernel
+ *
+ * Specialised replacement for GPMF_ScaledData for the common GoPro sample
+ * layout (big endian int16 or int32 elements with a SCAL per element or one
+ * for all). Byte swaps, converts and scales with SIMD, writing the floats
+ * straight into the destination buffer.
+ *
+ */
+
+#ifndef _GPMF_SCALE_H_
+#define _GPMF_SCALE_H_
+
+// basic stuff
+#include <stdint.h>
+#include "common.hpp"
+
+// includes for metadata parsing
+#include "GPMF_parser.h"
+
+namespace gpmf_scale
+{
+
+  // max number of elements per sample the kernel handles (GPS5 has 5,
+  // ACCL/GYRO have 3)
+  const uint32_t MAX_ELEMENTS = 16;
+
+  /*
+   * Scales samples * elements big endian values of type (GPMF_TYPE_SIGNED_SHORT
+   * or GPMF_TYPE_SIGNED_LONG) into dst (row major, one sample after the other).
+   * Each value is divided by scale[element] in float, like GPMF_ScaledData
+   * does. Returns false if the type is not supported.
+   */
+  bool scale_samples(const void *raw, uint32_t type, uint32_t samples,
+                     uint32_t elements, const float *scale, float *dst);
+
+  /*
+   * Scaled floats of the samples in the current key of ms, written straight
+   * to dst (samples * elements floats). Uses scale_samples when the stream
+   * layout allows it and falls back to GPMF_ScaledData otherwise.
+   */
+  GPMF_ERR scaled_data(GPMF_stream *ms, float *dst, uint32_t samples,
+                       uint32_t elements);
+
+}
+
+#endif // _GPMF_SCALE_H_
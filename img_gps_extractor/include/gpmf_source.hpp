@@ -0,0 +1,68 @@
+/*
+ * GPMF source
+ *
+ * Where the converter reads the GPMF payloads of a video from: the
+ * gpmf-parser mp4 reader, which opens the file on its own, or the demuxer of
+ * a decoder that has the file open already (see av_gpmf_source in
+ * frame_decoder.hpp). Payload and sample times always come from the mp4
+ * reader, so the samples are stamped the same with every decoder.
+ *
+ */
+
+#ifndef _GPMF_SOURCE_H_
+#define _GPMF_SOURCE_H_
+
+// basic stuff
+#include <string>
+#include <stdint.h>
+#include <memory>
+#include "common.hpp"
+
+// includes for metadata parsing
+#include "GPMF_parser.h"
+
+namespace gpmf_source
+{
+
+  // every call can come from any thread
+  class source
+  {
+    public:
+      virtual ~source(){}
+      virtual uint32_t payloads() = 0;
+      virtual uint32_t payload_size(uint32_t index) = 0; // bytes
+      // payload index and its size in bytes (NULL if it can't be read)
+      virtual std::shared_ptr<uint32_t> payload(uint32_t index, uint32_t& size) = 0;
+  };
+
+  // the gpmf-parser mp4 reader. It keeps the open file in globals, so there
+  // is one open at a time, and calls into it take turns.
+  class mp4reader_source : public source
+  {
+    public:
+      mp4reader_source();
+      ~mp4reader_source();
+      float open(const std::string& in); // duration (<= 0 if no metadata)
+      void close();
+      float duration();
+      uint32_t payloads();
+      uint32_t payload_size(uint32_t index);
+      std::shared_ptr<uint32_t> payload(uint32_t index, uint32_t& size);
+      bool payload_time(uint32_t index, float& in, float& out); // seconds
+      // rate of the samples of the current key of ms over the whole file, and
+      // the time of its samples in payload index (0 if unknown)
+      float sample_rate_and_times(GPMF_stream *ms, uint32_t index,
+                                  float& in, float& out);
+
+    private:
+      bool _open;
+      float _duration;
+  };
+
+  // if a has the payloads of b (same sizes, and the same bytes at both ends),
+  // so parsing either gives the same samples
+  bool same_payloads(source& a, source& b);
+
+}
+
+#endif // _GPMF_SOURCE_H_
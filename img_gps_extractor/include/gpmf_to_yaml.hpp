@@ -14,22 +14,38 @@
 // basic stuff
 #include <string>
 #include <stdint.h>
-#include <map>
 #include <vector>
+#include <memory>
 #include "common.hpp"
 
 // includes for metadata parsing
 #include "GPMF_parser.h"
 #include "GPMF_mp4reader.h"
+#include "gpmf_source.hpp"
 extern "C" void PrintGPMF(GPMF_stream *ms);
 
 // opencv stuff to get images
 #include "mp4_img_extractor.hpp"
 namespace img_extr = mp4_img_extractor;
 
+// imu deltas between images
+#include "imu_preintegration.hpp"
+namespace imu_pre = imu_preintegration;
+
 // libyaml stuff
 #include "yaml-cpp/yaml.h"
 
+// streams we extract
+#include "sensor_schema.hpp"
+namespace sc = sensor_schema;
+
+// streams the yaml to disk (optionally compressed)
+#include "metadata_writer.hpp"
+namespace md_wr = metadata_writer;
+
+// queues between the stages of the conversion
+#include "bounded_queue.hpp"
+
 namespace gpmf_to_yaml
 {
   
@@ -45,19 +61,34 @@ namespace gpmf_to_yaml
     CONV_INVALID_STRUCT,
   }CONV_RET;
 
+  // streams parsed, interpolated at every image and written to the yaml, in
+  // this order
+  typedef sc::schema_set<sc::gps5, sc::gpsf, sc::gpsp, sc::gyro, sc::accl,
+                         sc::isog, sc::shut> sensors_t;
+  typedef sc::sensor_stream_t sensor_stream_t;
+
   typedef struct
   {
+    uint32_t idx; // number of the image (its name), or of its frame in the timelapse
     float ts; // timestamp in seconds (from video start)
-    float gps[5]; // GPS data (lat deg, long deg, altitude m , 2D ground speed m/s, 3D speed m/s)
-    //gpst // GPS time (UTC)
-    //gpsf // GPS fix? 0-no lock. 2 or 3, 2D or 3D lock
-    //gpsp // GPS precision: Under 300 is good (tipically around 5m to 10m)
-    //gyro // IMU Gyroscope data rad/s
-    //accel // IMU Accelerometer data m/s²
-    //isog // ISO gain (dimensionless)
-    //ss // shutter speed in seconds
+    sensors_t::records sensors; // every stream at ts (sensors.get<sc::gps5>() etc)
+    double utc; // GPS time (UTC, seconds since the epoch) at ts, <0 if unknown
+    imu_pre::imu_interval_t imu; // IMU (gyro rad/s, accel m/s²) integrated from the previous image
   }sensorframe_t;
 
+  // one frame rate of the output. Several rates are extracted from one
+  // decode of the video, each with its own images, metadata and indexes.
+  typedef struct
+  {
+    float fr; // images per second
+    std::string dir; // subdirectory of the output directory it goes to ("" for itself)
+    uint32_t idx_offset; // index of its first image in the file (images of the previous files)
+  }rate_t;
+
+  // most metadata entries formatted by one worker at a time (blocks go out
+  // earlier if no more entries are waiting)
+  const size_t METADATA_BLOCK = 256;
+
   class converter
   {
     public:
@@ -66,35 +97,120 @@ namespace gpmf_to_yaml
       ~converter();
       int32_t init(); //re-init parsing with same parameters
       int32_t init(const std::string& in, const std::string& out_dir,float fr,const uint32_t idx_offset=0); //init parsing changing parameters
+      int32_t init(const std::string& in, const std::string& out_dir,const std::vector<rate_t>& rates); //same, with several frame rates
       int32_t cleanup(); //cleanup and exit
-      int32_t run(YAML::Emitter & out); //run conversion
-      int32_t get_offset(); //offset for next run
+      int32_t run(md_wr::writer & out); //run conversion, appending entries to out
+      int32_t run(const std::vector<md_wr::writer*>& out); //same, with the entries of every rate to its writer
+      int32_t get_offset(size_t rate=0); //offset for next run
+      const std::vector<sensorframe_t>& get_sensorframes(size_t rate=0); //frames of last run, in order
+      void set_range(float start, float end=-1); //only extract [start,end]s of the run (end<0 for all)
+      void set_fix_gate(uint32_t min_fix, float max_precision=0); //only extract images with this GPSF and GPSP at most (0 for any)
+      int32_t set_backend(img_extr::BACKEND backend); //decoder used for the images
+      void add_variant(const img_extr::variant_t& variant); //extra size/format of the images
+      void set_timelapse(const std::string& name); //images to this video in the output dir ("" for images)
+      int32_t finish(); //finishes the outputs that span files (the timelapse), after the last one
 
     private:
+      typedef struct
+      {
+        uint32_t index;
+        uint32_t size;
+        std::shared_ptr<uint32_t> data; // from the source
+        float in, out; // payload time
+      }payload_t;
+
+      typedef struct
+      {
+        float start, end; // seconds in the file
+      }interval_t;
+
+      typedef struct
+      {
+        float ts; // payload time
+        double utc; // its GPSU, seconds since the epoch (<0 if none)
+      }utc_t;
+
+      typedef struct
+      {
+        sensors_t::streams streams; // samples of one payload
+        utc_t utc;
+        float in, out; // payload time
+        bool unknown_axes; // GYRO/ACCL axes left as stored
+        int32_t ret;
+      }payload_chunk_t;
+
+      // stages of run(), each one feeding the next through a bounded queue
+      typedef pipeline::bounded_queue<payload_chunk_t> chunk_queue_t;
+      typedef struct
+      {
+        size_t rate; // index in _rates
+        sensorframe_t sf; // frame of the image
+        bool first; // first of its rate in the file (commented with where it was taken)
+      }entry_t;
+      typedef pipeline::bounded_queue<entry_t> entry_queue_t;
+      typedef struct
+      {
+        size_t rate; // of all its entries
+        std::vector<entry_t> entries;
+        std::string text; // their yaml, once done
+        bool done;
+      }block_t;
+      typedef pipeline::bounded_queue<std::shared_ptr<block_t>> block_queue_t;
+
+      // schema visitors (sensors_t::for_each) calling into the converter
+      struct parse_visitor;
+      struct append_visitor;
+
       std::string _input;
       std::string _output_dir;  
-      float _fr;
+      std::vector<rate_t> _rates;
       img_extr::img_extractor _extractor;
       bool _verbose;
-      uint32_t _idx_offset;
-      YAML::Emitter _out;
+      float _start, _end; // time range to extract (seconds from run start)
+      uint32_t _min_fix; // GPSF images need (0 for all)
+      float _max_precision; // GPSP images need at most (0 for any)
       
       // intermediate functions
-      int32_t gpmf_to_maps(); // take in stream and build maps
-      int32_t populate_images(); // get still images at desired framerate
-      int32_t sensors_to_sensorframes(); // interpolate at desired framerate
-      int32_t sensorframes_to_yaml(YAML::Emitter & out); // output desired yaml
+      int32_t gpmf_to_maps(chunk_queue_t& chunks); // parse stage: payload chunks, in order
+      int32_t merge_until(chunk_queue_t& chunks, float ts); // merge chunks until the samples around ts are in
+      int32_t parse_payload(const payload_t& p, GPMF_stream *ms,
+                            payload_chunk_t& chunk); // one payload into its chunk
+      int32_t payload_to_stream(GPMF_stream *ms, uint32_t fourcc,
+                                uint32_t index, uint32_t min_elements,
+                                sensor_stream_t& stream); // append one payload's samples
+      int32_t append_stream(const sensor_stream_t& from, sensor_stream_t& to);
+      bool find_axes(GPMF_stream *ms, uint32_t fourcc, const std::string& device,
+                     sc::axes_t& axes); // camera axes of a stream's samples (ORIN or model)
+      void update_fix(); // extend the good gps fix intervals with the new samples
+      bool in_fix(float ts); // if ts (in the file) has a good enough gps fix
+      int32_t populate_images(chunk_queue_t& chunks, entry_queue_t& entries); // frame stage: images at desired framerate
+      uint32_t images_in_file(size_t rate); // number of frame indexes this file spans
+      void file_range(size_t rate, float& start, float& end); // time range to extract in this file
+      void sensors_to_sensorframe(float ts, sensorframe_t& sf); // every stream at ts (in the file)
+      int32_t check_required(); // fails if images were extracted without a required stream
+      double utc_at(float ts); // GPS time at ts (<0 if unknown)
+      int32_t sensorframes_to_yaml(entry_queue_t& entries, const std::vector<md_wr::writer*>& out); // write stage: output desired yaml
+      int32_t write_block(const block_t& block, md_wr::writer& out); // text of a formatted block
+      void format_entry(const entry_t& entry, std::string& text); // yaml of one image
 
-      // maps for parsed values
-      std::map<float,std::vector<float> > _gps; //ts is key, gps data is value
+      // parsed values
+      sensors_t::streams _streams; // samples of every stream
+      std::vector<utc_t> _utc; // GPSU of every payload, in time order
+      std::vector<interval_t> _fix; // good fix intervals, in time order
+      size_t _fix_samples; // GPSF samples already in _fix
+      bool _gated; // if images are limited to _fix
+      bool _parsed; // all chunks of the run merged
+      float _merged_in; // start of the last payload merged
+      bool _axes_warned; // about streams with unknown camera axes
 
-      //map for interpolated values
-      std::map<std::string,sensorframe_t> _sensor_frames; //this is what we store in yaml (key is image name, and value is a sensor frame)
-      uint32_t _n_images; // final number of images in database
+      //interpolated values of every image, one list per rate in image order
+      std::vector<std::vector<sensorframe_t>> _sensor_frames; //this is what we store in yaml (sf.idx is the image name)
 
       // gpmf data
       GPMF_stream _metadata_stream, *_ms;
       float _metadatalength;
+      gpmf_source::mp4reader_source _reader; // payload and sample times
+      gpmf_source::source *_source; // payloads of the file (the reader's or the decoder's), until cleanup
       uint32_t *_payload; //buffer to store GPMF samples from the MP4.
 
   };
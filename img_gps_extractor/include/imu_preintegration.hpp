@@ -0,0 +1,70 @@
+/*
+ * IMU preintegration
+ *
+ * Integrates gyroscope and accelerometer samples between consecutive
+ * extracted images into relative rotation, velocity and position deltas
+ * (expressed in the IMU frame at the first image of the interval), in one
+ * forward pass over the samples.
+ *
+ */
+
+#ifndef _IMU_PREINTEGRATION_H_
+#define _IMU_PREINTEGRATION_H_
+
+// basic stuff
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "common.hpp"
+
+namespace imu_preintegration
+{
+
+  typedef struct
+  {
+    float dt; // integrated time in seconds
+    float dq[4]; // rotation delta as quaternion (w, x, y, z)
+    float dv[3]; // velocity delta in m/s (gravity not removed)
+    float dp[3]; // position delta in m (gravity not removed)
+    uint32_t n_gyro; // gyro samples inside the interval
+    uint32_t n_accl; // accelerometer samples inside the interval
+  }imu_interval_t;
+
+  // empty interval (no time, identity rotation)
+  void reset(imu_interval_t& interval);
+
+  class preintegrator
+  {
+    public:
+      // samples are x,y,z in the camera axes (see sensor_schema::to_camera)
+      // in the first 3 values of each stride, time ordered.
+      // Streams are held by reference (stride included), so they can keep
+      // growing between calls as long as it is past the last interval.
+      preintegrator(const std::vector<float>& gyro_ts, const std::vector<float>& gyro,
+                    const uint32_t& gyro_stride,
+                    const std::vector<float>& accl_ts, const std::vector<float>& accl,
+                    const uint32_t& accl_stride);
+
+      // integrates [t0, t1]. Intervals have to come in time order, since the
+      // sample cursors only move forward.
+      void integrate(float t0, float t1, imu_interval_t& interval);
+
+    private:
+      typedef struct
+      {
+        const std::vector<float>& ts;
+        const std::vector<float>& data;
+        const uint32_t& stride;
+        size_t cursor; // last sample at or before the current time
+      }stream_t;
+
+      stream_t _gyro;
+      stream_t _accl;
+
+      void sample(stream_t& s, double t, double v[3]); // linear interpolation
+      uint32_t count(stream_t& s, double t0, double t1); // samples in (t0, t1]
+  };
+
+}
+
+#endif // _IMU_PREINTEGRATION_H_
@@ -0,0 +1,73 @@
+/*
+ * Multi-session ingest
+ *
+ * Recursively discovers GoPro recordings in a directory tree (eg. a whole
+ * SD card dump), groups the chapters of each recording together and runs
+ * every recording (session) through a pool of workers.
+ *
+ */
+
+#ifndef _INGEST_H_
+#define _INGEST_H_
+
+// basic stuff
+#include <string>
+#include <stdint.h>
+#include <vector>
+#include <functional>
+#include "common.hpp"
+
+namespace ingest
+{
+
+  typedef enum
+  {
+    INGEST_OK = 0,
+    INGEST_ERROR,
+    INGEST_INPUT_NON_EXISTENT,
+    INGEST_NO_SESSIONS,
+    INGEST_CANT_SPAWN,
+    INGEST_SESSION_FAILED,
+  }INGEST_RET;
+
+  typedef struct
+  {
+    std::string name; // relative output subtree for the session (dir/GX0001)
+    std::string family; // naming family (GP for GOPR/GPxx, GH, GX)
+    uint32_t number; // recording number (last 4 digits of the name)
+    std::vector<std::string> files; // chapters, ordered by chapter index
+  }session_t;
+
+  // job to run for each session. Returns 0 on success.
+  typedef std::function<int32_t(const session_t&)> session_job;
+
+  /*
+   * Parses a GoPro file name into its naming family, recording number and
+   * chapter index. Understands:
+   *  - GOPRxxxx.MP4: first chapter of recording xxxx (Hero5 and older)
+   *  - GPccxxxx.MP4: chapter cc of recording xxxx (Hero5 and older)
+   *  - GHccxxxx.MP4: chapter cc of recording xxxx (Hero6+, AVC)
+   *  - GXccxxxx.MP4: chapter cc of recording xxxx (Hero6+, HEVC)
+   * Returns false if the name is not a GoPro video.
+   */
+  bool parse_name(const std::string& filename, std::string& family,
+                  uint32_t& number, uint32_t& chapter);
+
+  // recursively find all recordings under root, grouped by chapters
+  int32_t discover_sessions(const std::string& root,
+                            std::vector<session_t>& sessions,
+                            bool verbose=false);
+
+  /*
+   * Runs job for every session, with at most max_jobs at the same time.
+   * The gpmf-parser mp4 reader keeps its state in globals, so every session
+   * gets its own worker process (forked from this one). Returns INGEST_OK if
+   * all sessions succeeded.
+   */
+  int32_t run_sessions(const std::vector<session_t>& sessions,
+                       uint32_t max_jobs, const session_job& job,
+                       bool verbose=false);
+
+}
+
+#endif // _INGEST_H_
@@ -0,0 +1,99 @@
+/*
+ * Metadata writer
+ *
+ * Streams the metadata document to disk as it is produced, optionally
+ * compressed (chosen by the file extension: .gz for gzip, .zst for zstd).
+ * The text is cut in blocks that are compressed in parallel, each one as an
+ * independent gzip member or zstd frame, and written in order. Standard
+ * tools (gunzip, zcat, zstd -d) decompress the concatenation as one stream.
+ *
+ */
+
+#ifndef _METADATA_WRITER_H_
+#define _METADATA_WRITER_H_
+
+// basic stuff
+#include <string>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "common.hpp"
+
+namespace metadata_writer
+{
+
+  typedef enum
+  {
+    WRITER_OK = 0,
+    WRITER_ERROR,
+    WRITER_CANT_OPEN,
+    WRITER_CANT_WRITE,
+    WRITER_UNSUPPORTED, // compression not built in
+  }WRITER_RET;
+
+  typedef enum
+  {
+    COMPRESS_NONE = 0,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD,
+  }COMPRESSION;
+
+  // uncompressed bytes per block
+  const size_t BLOCK_SIZE = 1 << 20;
+
+  // compression for a file name, from its extension
+  COMPRESSION compression_for(const std::string& path);
+
+  class writer
+  {
+    public:
+      writer(bool verbose=false);
+      ~writer(); // closes, so a forgotten close() still writes everything
+      // threads <= 0 uses one per core
+      int32_t open(const std::string& path, int32_t threads=0);
+      int32_t write(const char *data, size_t size);
+      int32_t write(const std::string& text);
+      uint64_t written() const { return _written; } // text bytes since open
+      int32_t close(); // flushes and waits for the last blocks
+
+    private:
+      typedef struct
+      {
+        std::string in; // text
+        std::string out; // compressed
+        bool done;
+        bool ok;
+      }block_t;
+
+      FILE *_file;
+      COMPRESSION _compression;
+      std::string _buffer; // text of the block being filled
+      uint64_t _written;
+      bool _verbose;
+      int32_t _ret; // first error
+
+      // compression workers. Blocks are queued in order in _blocks, and the
+      // ones not picked up yet in _todo.
+      std::vector<std::thread> _workers;
+      std::deque<std::shared_ptr<block_t>> _blocks;
+      std::deque<std::shared_ptr<block_t>> _todo;
+      std::mutex _mutex;
+      std::condition_variable _work_cv; // new block or stop
+      std::condition_variable _done_cv; // block compressed
+      size_t _max_blocks; // in flight, bounds the memory used
+      bool _stop;
+
+      void worker();
+      bool compress(block_t& block);
+      int32_t submit(); // hands the buffer to the workers
+      int32_t drain(size_t keep); // writes done blocks until <= keep left
+  };
+
+}
+
+#endif // _METADATA_WRITER_H_
@@ -17,19 +17,38 @@
 // basic stuff
 #include <string>
 #include <iostream>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "common.hpp"
 
+// decoding backends
+#include "frame_decoder.hpp"
+
+// gps tags in the jpegs
+#include "exif_writer.hpp"
+
+// single video output
+#include "timelapse_writer.hpp"
+
+// variants to the encoder threads
+#include "bounded_queue.hpp"
+
 namespace mp4_img_extractor
 {
 
-  typedef enum
+  typedef struct
   {
-    EXTR_OK=0,
-    EXTR_SKIPPING_FRAME,
-    EXTR_ERROR,
-    EXTR_CANT_LOAD_VIDEO,
-    EXTR_CANT_FRAME_OUT_OF_BOUNDS,
-  }EXTR_RET;
+    uint32_t size; // longest side in px (0 keeps the decoded size)
+    std::string format; // file extension: jpg, png, webp...
+    int32_t quality; // jpg/webp quality (0-100), png compression (0-9), -1 default
+    std::string dir; // subdirectory of the output directory ("" for itself)
+  }variant_t;
+
+  // variant from "size:format[:quality[:dir]]". False if malformed.
+  bool parse_variant(const std::string& arg, variant_t& variant);
 
   class img_extractor
   {
@@ -39,15 +58,63 @@ namespace mp4_img_extractor
       ~img_extractor();
       int32_t init();
       int32_t init(const std::string& in, const std::string& out_dir);
-      int32_t get_frame(float ts, float & real_ts, uint32_t idx, std::string &name);
+      // decodes the frame closest to ts (unless it is the one already decoded)
+      int32_t get_frame(float ts, float & real_ts);
+      // saves the decoded frame as image idx of the output in every variant,
+      // with the gps tags in the jpegs (NULL for none). number is what it was
+      // saved as: idx, or its frame number in the timelapse.
+      int32_t save_frame(uint32_t idx, const exif_writer::gps_tags_t *tags, uint32_t &number,
+                         size_t output=0);
+      std::string frame_name(uint32_t number) const; // of a saved frame (000042.jpg, or 000042 in a timelapse)
+      float get_duration(); // duration of the video in seconds
+      gpmf_source::source* gpmf(); // metadata track of the open video, if the decoder reads it (NULL if not)
+      int32_t set_backend(BACKEND backend); // decoder for the next init
+      void add_variant(const variant_t& variant); // extra output of every frame
+      // subdirectories of the output directory frames can be saved to, each
+      // with its own variants and timelapse ({""} for the output directory)
+      void set_outputs(const std::vector<std::string>& dirs);
+      // frames go to this video in the output directory instead of images
+      // ("" for images), and are named by their number in it
+      void set_timelapse(const std::string& name);
+      int32_t finish(); // finishes the timelapses, the next frame starts new ones
 
     private:
       std::string _input;
       std::string _output_dir;
-      cv::VideoCapture _cap;
+      bool _verbose;
+      BACKEND _backend;
+      std::unique_ptr<frame_decoder> _decoder;
+      std::string _opened; // video the decoder has open
       cv::Mat _frame;
+      int64_t _frame_num; // frame of the video in _frame (-1 if none)
+      float _frame_ts; // and its timestamp
       float _duration;
-      bool _verbose;
+      std::vector<variant_t> _variants; // full size jpg first, then the extra ones
+      std::vector<std::string> _outputs;
+      std::string _timelapse_name;
+      std::vector<std::unique_ptr<timelapse_writer>> _timelapse; // one per output
+
+      // one extra variant of the frame being saved, for the encoder threads
+      typedef struct
+      {
+        size_t variant;
+        const std::string *dir, *stem, *app1;
+        char *ok;
+      }encode_t;
+
+      // encoders of the extra variants, started with the first frame that
+      // has them and kept until the extractor goes
+      std::vector<std::thread> _encoders;
+      std::unique_ptr<pipeline::bounded_queue<encode_t>> _encode_queue;
+      std::mutex _encode_mutex;
+      std::condition_variable _encoded;
+      size_t _encoding; // variants of the current frame not saved yet
+
+      std::string output_dir(size_t output); // directory of the output
+      bool save_variant(const variant_t& variant, const std::string& dir,
+                        const std::string& stem, const std::string& app1);
+      void start_encoders(size_t n); // at least n encoder threads
+      void encoder(); // saves queued variants until the queue is closed
   };
 
 }
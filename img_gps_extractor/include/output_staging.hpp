@@ -0,0 +1,82 @@
+/*
+ * Output staging
+ *
+ * Runs write to a staging directory next to their output, which is swapped
+ * into place only when the run succeeds, so a failed run never touches the
+ * previous output. Replaced trees are moved to the trash with a rename and
+ * deleted by a background thread at idle priority, instead of blocking the
+ * start of the run.
+ *
+ */
+
+#ifndef _OUTPUT_STAGING_H_
+#define _OUTPUT_STAGING_H_
+
+// basic stuff
+#include <string>
+#include <stdint.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "common.hpp"
+
+namespace output_staging
+{
+
+  typedef enum
+  {
+    STAGING_OK = 0,
+    STAGING_ERROR,
+    STAGING_CANT_CREATE,
+    STAGING_CANT_SWAP,
+  }STAGING_RET;
+
+  // deletes trashed trees in the background. Whatever is left when it is
+  // destroyed stays in the trash, and is found again by sweep() on the next
+  // run of the same output.
+  class remover
+  {
+    public:
+      remover(bool verbose=false);
+      ~remover(); // stops between two files, without waiting for the rest
+      void remove(const std::string& path); // queues a tree
+      void sweep(const std::string& output); // trash and dead staging dirs left next to output
+      void hold(); // before the first remove(): queues without starting the thread, until resume() (to fork)
+      void resume(); // starts deleting what was queued meanwhile
+
+    private:
+      bool _verbose;
+      std::deque<std::string> _queue;
+      std::thread _thread; // started with the first tree
+      std::mutex _mutex;
+      std::condition_variable _cv;
+      std::atomic<bool> _stop;
+      bool _held;
+
+      void worker();
+      bool remove_tree(const std::string& path); // false if stopped halfway
+  };
+
+  // an output directory, written through a staging directory
+  class staged_dir
+  {
+    public:
+      staged_dir(const std::string& output, remover& trash, bool verbose=false);
+      ~staged_dir(); // trashes the staging directory if it wasn't committed
+      int32_t open(); // creates the empty staging directory
+      const std::string& path() const { return _staging; } // where the run writes
+      int32_t commit(); // swaps it into place, the previous output goes to the trash
+
+    private:
+      std::string _output;
+      std::string _staging;
+      remover& _trash;
+      bool _verbose;
+      bool _open;
+  };
+
+}
+
+#endif // _OUTPUT_STAGING_H_
@@ -0,0 +1,343 @@
+/*
+ * Sensor schemas
+ *
+ * Compile time description of every GPMF stream we extract (FourCC, number
+ * of elements, names and interpolation). From the list of schemas the
+ * templates below generate the per image record layout, the interpolation
+ * and the yaml output, with the element loops unrolled and no per sample
+ * dispatch or lookups.
+ *
+ * Adding a stream means adding its schema here and to sensors_t in
+ * gpmf_to_yaml.hpp.
+ *
+ */
+
+#ifndef _SENSOR_SCHEMA_H_
+#define _SENSOR_SCHEMA_H_
+
+// basic stuff
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <array>
+#include <tuple>
+#include <algorithm>
+
+// includes for metadata parsing
+#include "GPMF_parser.h"
+
+// yaml text of the values
+#include "yaml_format.hpp"
+
+namespace sensor_schema
+{
+
+  typedef enum
+  {
+    INTERP_LINEAR = 0, // between the samples around the image
+    INTERP_NEAREST, // closest sample (settings that step, like iso)
+  }INTERP;
+
+  typedef struct
+  {
+    uint32_t elements; // values per sample
+    std::vector<float> ts; // timestamp of each sample, in time order
+    std::vector<float> data; // scaled values, one sample after the other
+  }sensor_stream_t;
+
+  // where the camera x, y, z axes are in the first 3 elements of a sample:
+  // axis i is sign[i] * element[index[i]]
+  typedef struct
+  {
+    uint32_t index[3];
+    float sign[3];
+  }axes_t;
+
+  // from an ORIN string, the camera axis of each element ("ZXY" is element 0
+  // on z, 1 on x and 2 on y), lower case for a negated axis
+  inline bool parse_orin(const char *orin, uint32_t size, axes_t& axes)
+  {
+    if(size < 3)
+      return false;
+    bool found[3] = {false, false, false};
+    for(uint32_t e = 0; e < 3; e++)
+    {
+      char c = orin[e];
+      bool negated = c >= 'x' && c <= 'z';
+      uint32_t i = negated ? c - 'x' : c - 'X';
+      if(i > 2 || found[i])
+        return false;
+      found[i] = true;
+      axes.index[i] = e;
+      axes.sign[i] = negated ? -1.0f : 1.0f;
+    }
+    return true;
+  }
+
+  // reorders the first 3 elements of every sample to the camera axes
+  inline void to_camera(const axes_t& axes, float *data, size_t samples,
+                        uint32_t elements)
+  {
+    for(size_t s = 0; s < samples; s++, data += elements)
+    {
+      float v[3] = {data[0], data[1], data[2]};
+      for(uint32_t i = 0; i < 3; i++)
+        data[i] = axes.sign[i] * v[axes.index[i]];
+    }
+  }
+
+  /*
+   * Schemas. Each one has:
+   *  - fourcc(): key of the stream in the GPMF payload
+   *  - elements: values we keep per sample (the first ones of the stream)
+   *  - interp: how values are taken at the image timestamps
+   *  - required: conversion fails if the video doesn't have it
+   *  - camera_axes: the first 3 elements are x, y, z of a sensor, stored in
+   *    the order of the camera model, and reordered to the camera axes
+   *  - key(), name(i): yaml key of the stream and of each element (single
+   *    element streams are written as a scalar)
+   */
+  struct gps5
+  {
+    static uint32_t fourcc() { return STR2FOURCC("GPS5"); }
+    static const uint32_t elements = 5;
+    static const INTERP interp = INTERP_LINEAR;
+    static const bool required = true;
+    static const bool camera_axes = false;
+    static const char *key() { return "gps"; }
+    static const char *name(uint32_t i)
+    {
+      // lat deg, long deg, altitude m, 2D ground speed m/s, 3D speed m/s
+      static const char *const names[] = {"lat", "long", "alt", "2dv", "3dv"};
+      return names[i];
+    }
+  };
+
+  struct gpsf
+  {
+    static uint32_t fourcc() { return STR2FOURCC("GPSF"); }
+    static const uint32_t elements = 1;
+    static const INTERP interp = INTERP_NEAREST;
+    static const bool required = false;
+    static const bool camera_axes = false;
+    static const char *key() { return "gps_fix"; } // 0 no lock, 2 2D lock, 3 3D lock
+    static const char *name(uint32_t i) { return "fix"; }
+  };
+
+  struct gpsp
+  {
+    static uint32_t fourcc() { return STR2FOURCC("GPSP"); }
+    static const uint32_t elements = 1;
+    static const INTERP interp = INTERP_NEAREST;
+    static const bool required = false;
+    static const bool camera_axes = false;
+    static const char *key() { return "gps_precision"; } // dilution of precision x100, under 500 is good
+    static const char *name(uint32_t i) { return "dop"; }
+  };
+
+  struct gyro
+  {
+    static uint32_t fourcc() { return STR2FOURCC("GYRO"); }
+    static const uint32_t elements = 3;
+    static const INTERP interp = INTERP_LINEAR;
+    static const bool required = false;
+    static const bool camera_axes = true;
+    static const char *key() { return "gyro"; } // rad/s
+    static const char *name(uint32_t i)
+    {
+      static const char *const names[] = {"x", "y", "z"};
+      return names[i];
+    }
+  };
+
+  struct accl
+  {
+    static uint32_t fourcc() { return STR2FOURCC("ACCL"); }
+    static const uint32_t elements = 3;
+    static const INTERP interp = INTERP_LINEAR;
+    static const bool required = false;
+    static const bool camera_axes = true;
+    static const char *key() { return "accl"; } // m/s²
+    static const char *name(uint32_t i)
+    {
+      static const char *const names[] = {"x", "y", "z"};
+      return names[i];
+    }
+  };
+
+  struct isog
+  {
+    static uint32_t fourcc() { return STR2FOURCC("ISOG"); }
+    static const uint32_t elements = 1;
+    static const INTERP interp = INTERP_NEAREST;
+    static const bool required = false;
+    static const bool camera_axes = false;
+    static const char *key() { return "iso"; } // sensor gain (dimensionless)
+    static const char *name(uint32_t i) { return "gain"; }
+  };
+
+  struct shut
+  {
+    static uint32_t fourcc() { return STR2FOURCC("SHUT"); }
+    static const uint32_t elements = 1;
+    static const INTERP interp = INTERP_NEAREST;
+    static const bool required = false;
+    static const bool camera_axes = false;
+    static const char *key() { return "shutter"; } // exposure time in s
+    static const char *name(uint32_t i) { return "time"; }
+  };
+
+  // values of one stream at one image
+  template<class S>
+  struct record
+  {
+    float v[S::elements];
+    bool valid; // false if the video doesn't have the stream
+  };
+
+  // value of the stream at ts, following the schema's policy
+  template<class S>
+  void interpolate(const sensor_stream_t& stream, float ts, record<S>& r)
+  {
+    size_t n = stream.ts.size();
+    r.valid = n > 0 && stream.elements >= S::elements;
+    if(!r.valid)
+      return;
+
+    // samples in time order, so look for the first sample after the image.
+    // Before the first sample, after the last one, or in the coincidence,
+    // there is only one to take.
+    size_t next = std::upper_bound(stream.ts.begin(), stream.ts.end(), ts) - stream.ts.begin();
+    size_t prev = next > 0 ? next - 1 : 0;
+    if(next == 0 || next == n || stream.ts[prev] == ts)
+      next = prev;
+    float prev_ts = stream.ts[prev], next_ts = stream.ts[next];
+    const float *a = &stream.data[prev * stream.elements];
+    const float *b = &stream.data[next * stream.elements];
+
+    if(S::interp == INTERP_LINEAR && next_ts > prev_ts)
+    {
+      float delta_ts = next_ts - prev_ts;
+      for(uint32_t i = 0; i < S::elements; i++)
+      {
+        float m = (b[i] - a[i]) / delta_ts;
+        r.v[i] = a[i] + m * (ts - prev_ts);
+      }
+    }
+    else
+    {
+      const float *c = next_ts - ts < ts - prev_ts ? b : a;
+      for(uint32_t i = 0; i < S::elements; i++)
+        r.v[i] = c[i];
+    }
+  }
+
+  // yaml for one stream of an image, as a key of the image's map (nothing
+  // if the video doesn't have it)
+  template<class S>
+  void format(std::string& text, const record<S>& r)
+  {
+    if(!r.valid)
+      return;
+
+    text += "  ";
+    text += S::key();
+    text += ":";
+    if(S::elements == 1)
+    {
+      text += " ";
+      yaml_format::append_float(text, r.v[0]);
+      text += "\n";
+      return;
+    }
+
+    text += "\n";
+    for(uint32_t i = 0; i < S::elements; i++)
+    {
+      text += "    ";
+      text += S::name(i);
+      text += ": ";
+      yaml_format::append_float(text, r.v[i]);
+      text += "\n";
+    }
+  }
+
+  // position of T in S...
+  template<class T, class... S> struct index_of;
+  template<class T, class... S>
+  struct index_of<T, T, S...>
+  {
+    static const size_t value = 0;
+  };
+  template<class T, class U, class... S>
+  struct index_of<T, U, S...>
+  {
+    static const size_t value = 1 + index_of<T, S...>::value;
+  };
+
+  // calls f.visit<S>() for each schema in order, until one returns non 0
+  template<class F, class... S> struct for_each_impl;
+  template<class F>
+  struct for_each_impl<F>
+  {
+    static int32_t apply(F& f) { return 0; }
+  };
+  template<class F, class H, class... T>
+  struct for_each_impl<F, H, T...>
+  {
+    static int32_t apply(F& f)
+    {
+      int32_t ret = f.template visit<H>();
+      return ret ? ret : for_each_impl<F, T...>::apply(f);
+    }
+  };
+
+  template<class... S>
+  struct schema_set
+  {
+    // one record per schema, laid out at compile time
+    struct records
+    {
+      std::tuple<record<S>...> r;
+
+      template<class T> record<T>& get()
+      {
+        return std::get<index_of<T, S...>::value>(r);
+      }
+      template<class T> const record<T>& get() const
+      {
+        return std::get<index_of<T, S...>::value>(r);
+      }
+    };
+
+    // parsed samples, one stream per schema
+    struct streams
+    {
+      std::array<sensor_stream_t, sizeof...(S)> s;
+
+      streams()
+      {
+        for(auto& stream:s)
+          stream.elements = 0;
+      }
+      template<class T> sensor_stream_t& get()
+      {
+        return s[index_of<T, S...>::value];
+      }
+      template<class T> const sensor_stream_t& get() const
+      {
+        return s[index_of<T, S...>::value];
+      }
+    };
+
+    template<class F>
+    static int32_t for_each(F& f)
+    {
+      return for_each_impl<F, S...>::apply(f);
+    }
+  };
+
+}
+
+#endif // _SENSOR_SCHEMA_H_
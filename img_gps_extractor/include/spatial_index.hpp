@@ -0,0 +1,117 @@
+/*
+ * Spatial index
+ *
+ * Grid index over the interpolated lat/long of every extracted image,
+ * persisted next to metadata.yaml so that radius, bounding box and nearest
+ * neighbour queries don't need to parse and scan the whole yaml.
+ *
+ * File layout (little endian):
+ *  - header_t
+ *  - n_cells cell_t, sorted by (row, col)
+ *  - n_entries entry_t, grouped by cell in the same order
+ *
+ */
+
+#ifndef _SPATIAL_INDEX_H_
+#define _SPATIAL_INDEX_H_
+
+// basic stuff
+#include <string>
+#include <stdint.h>
+#include <vector>
+#include "common.hpp"
+
+namespace spatial_index
+{
+
+  typedef enum
+  {
+    INDEX_OK = 0,
+    INDEX_ERROR,
+    INDEX_CANT_OPEN,
+    INDEX_CANT_WRITE,
+    INDEX_INVALID_FILE,
+  }INDEX_RET;
+
+  typedef struct
+  {
+    char magic[8]; // "GPSIDX1"
+    double cell_deg; // size of a grid cell in degrees
+    uint32_t n_cells;
+    uint32_t n_entries;
+  }header_t;
+
+  typedef struct
+  {
+    uint32_t row; // (lat + 90) / cell_deg
+    uint32_t col; // (long + 180) / cell_deg
+    uint32_t first; // first entry of the cell
+    uint32_t count; // number of entries in the cell
+  }cell_t;
+
+  typedef struct
+  {
+    float lat; // degrees
+    float lon; // degrees
+    uint32_t idx; // image number (idx of NNNNNN.jpg)
+  }entry_t;
+
+  typedef struct
+  {
+    entry_t entry;
+    double dist; // meters from the query point (0 for bbox queries)
+  }result_t;
+
+  // default cell size, ~110m in latitude
+  const double DEFAULT_CELL_DEG = 0.001;
+
+  // great circle distance in meters
+  double distance(double lat1, double lon1, double lat2, double lon2);
+
+  // image name for an index, same as the one written by the extractor
+  std::string image_name(uint32_t idx);
+
+  class builder
+  {
+    public:
+      builder(double cell_deg=DEFAULT_CELL_DEG);
+      void add(uint32_t idx, float lat, float lon); // add one image
+      int32_t save(const std::string& path); // sort in cells and write
+      size_t size() const;
+
+    private:
+      double _cell_deg;
+      std::vector<entry_t> _entries;
+  };
+
+  class index
+  {
+    public:
+      index(bool verbose=false);
+      ~index();
+      int32_t load(const std::string& path); // map the index file
+      void bbox(double min_lat, double min_lon, double max_lat, double max_lon,
+                std::vector<result_t>& results) const;
+      void radius(double lat, double lon, double meters,
+                  std::vector<result_t>& results) const; // sorted by distance
+      void nearest(double lat, double lon, uint32_t k,
+                   std::vector<result_t>& results) const; // sorted by distance
+      size_t size() const;
+
+    private:
+      bool _verbose;
+      void *_map; // mmapped file
+      size_t _map_size;
+      const header_t *_header;
+      const cell_t *_cells;
+      const entry_t *_entries;
+      uint32_t _min_col, _max_col; // column extent of the cells
+
+      const cell_t* find_cell(uint32_t row, uint32_t col) const; // first cell >= (row, col)
+      void collect_rows(uint32_t row0, uint32_t row1, uint32_t col0, uint32_t col1,
+                        std::vector<result_t>& results) const; // all entries in cell range
+  };
+
+}
+
+#endif // _SPATIAL_INDEX_H_
@@ -0,0 +1,62 @@
+/*
+ * Timelapse writer
+ *
+ * Encodes the extracted frames into a single video instead of one image
+ * each. Frames are queued and encoded by a background thread, so extraction
+ * keeps decoding while the encoder works.
+ *
+ */
+
+#ifndef _TIMELAPSE_WRITER_H_
+#define _TIMELAPSE_WRITER_H_
+
+// opencv stuff to encode the video
+#include "opencv2/opencv.hpp"
+
+// basic stuff
+#include <string>
+#include <memory>
+#include <thread>
+#include <stdint.h>
+#include "common.hpp"
+
+// frames to the encoder thread
+#include "bounded_queue.hpp"
+
+namespace mp4_img_extractor
+{
+
+  // playback rate of the timelapse (frames are keyed by number, not time)
+  const double TIMELAPSE_FPS = 30;
+
+  // frames waiting for the encoder, bounds the memory used
+  const size_t TIMELAPSE_QUEUE = 4;
+
+  class timelapse_writer
+  {
+    public:
+      timelapse_writer(bool verbose=false);
+      ~timelapse_writer(); // closes, so a forgotten close() still writes everything
+      int32_t open(const std::string& path); // the video is created on the first frame
+      int32_t write(const cv::Mat& frame); // queues a copy, waits if the encoder is behind
+      int32_t close(); // waits for the queued frames and finishes the video
+      bool is_open() { return !_path.empty(); }
+      uint32_t frames() { return _frames; } // written so far
+
+    private:
+      std::string _path;
+      bool _verbose;
+      cv::VideoWriter _writer; // only used by the encoder thread once started
+      cv::Size _size; // of the video, other frames are resized to it
+      uint32_t _frames;
+      int32_t _ret; // first error
+
+      std::thread _thread;
+      std::unique_ptr<pipeline::bounded_queue<cv::Mat>> _queue; // one per video
+
+      void worker();
+  };
+
+}
+
+#endif // _TIMELAPSE_WRITER_H_
@@ -0,0 +1,70 @@
+/*
+ * Watch folder
+ *
+ * Long running mode that watches a spool directory with inotify and
+ * converts every recording as soon as all of its chapters have landed and
+ * stopped changing.
+ *
+ */
+
+#ifndef _WATCH_FOLDER_H_
+#define _WATCH_FOLDER_H_
+
+// basic stuff
+#include <string>
+#include <stdint.h>
+#include <vector>
+#include <map>
+#include <set>
+#include "common.hpp"
+
+// session discovery
+#include "ingest.hpp"
+
+namespace watch_folder
+{
+
+  typedef enum
+  {
+    WATCH_OK = 0,
+    WATCH_ERROR,
+    WATCH_INPUT_NON_EXISTENT,
+    WATCH_CANT_INIT_INOTIFY,
+  }WATCH_RET;
+
+  class watcher
+  {
+    public:
+      watcher(const std::string& dir, float settle_time, bool verbose=false);
+      ~watcher();
+      int32_t init(); // start watching the directory tree
+      int32_t run(const ingest::session_job& job); // loop until stop()
+      static void stop(); // ask the loop to exit (safe from signal handlers)
+
+    private:
+      typedef struct
+      {
+        ingest::session_t session; // last seen layout of the recording
+        std::vector<std::pair<std::string,uintmax_t> > signature; // files and sizes
+        double last_change; // monotonic time of the last signature change
+        bool done; // converted with this signature already
+      }session_state_t;
+
+      std::string _dir;
+      float _settle_time; // seconds without changes to consider a session complete
+      bool _verbose;
+      int _fd; // inotify instance
+      std::map<int,std::string> _watches; // watch descriptor -> directory
+      std::set<std::string> _writing; // files opened for writing right now
+      std::map<std::string,session_state_t> _sessions; // by session name
+      bool _dirty; // something changed since last scan
+
+      int32_t add_watch(const std::string& dir); // watch dir and all subdirs
+      void read_events(); // drain the inotify queue
+      void overflow(); // events were lost, fall back to sizes
+      void scan(); // update the session states from disk
+  };
+
+}
+
+#endif // _WATCH_FOLDER_H_
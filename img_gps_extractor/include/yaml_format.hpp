@@ -0,0 +1,28 @@
+/*
+ * YAML format
+ *
+ * Scalars formatted straight into a text buffer, with the same text the
+ * yaml-cpp emitter would write for them, so the metadata can be formatted
+ * on several threads without an emitter (and its stringstream) per value.
+ *
+ */
+
+#ifndef _YAML_FORMAT_H_
+#define _YAML_FORMAT_H_
+
+// basic stuff
+#include <string>
+#include <stdint.h>
+
+namespace yaml_format
+{
+
+  // as the emitter writes a float: %.*g at its float precision, and .nan,
+  // .inf or -.inf
+  void append_float(std::string& out, float v);
+
+  void append_uint(std::string& out, uint32_t v);
+
+}
+
+#endif // _YAML_FORMAT_H_
@@ -0,0 +1,361 @@
+/*
+ * libav frame decoder
+ *
+ * Demuxes and decodes the video track with libavformat/libavcodec directly:
+ * frame and slice threading over all cores, seeking to the keyframe before
+ * the exact frame requested (from the frame index) and decoding forward to
+ * it, and converting only the frames that are returned to bgr. The GPMF
+ * payloads are read through the same open file.
+ *
+ */
+
+#ifdef WITH_LIBAV
+
+// class definitions
+#include "frame_decoder.hpp"
+
+// basic stuff
+#include <iostream>
+#include <thread>
+#include <algorithm>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+}
+
+namespace mp4_img_extractor
+{
+
+  // index entries of a stream, in decode order (behind accessors since
+  // libavformat 58.78)
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+  static int index_size(AVStream *st)
+  {
+    return avformat_index_get_entries_count(st);
+  }
+  static const AVIndexEntry *index_entry(AVStream *st, int i)
+  {
+    return avformat_index_get_entry(st, i);
+  }
+#else
+  static int index_size(AVStream *st)
+  {
+    return st->nb_index_entries;
+  }
+  static const AVIndexEntry *index_entry(AVStream *st, int i)
+  {
+    return &st->index_entries[i];
+  }
+#endif
+
+  av_gpmf_source::av_gpmf_source(std::mutex& io, bool verbose):_fmt(NULL),_io(io),
+                                                              _verbose(verbose)
+  {
+  }
+
+  bool av_gpmf_source::load(AVFormatContext *fmt)
+  {
+    clear();
+
+    // the camera's metadata track: a data stream of gpmd samples, one
+    // payload each, all of them as the mp4 reader indexes them
+    for(unsigned int s = 0; s < fmt->nb_streams; s++)
+    {
+      AVStream *st = fmt->streams[s];
+      if(st->codecpar->codec_type != AVMEDIA_TYPE_DATA ||
+         st->codecpar->codec_tag != MKTAG('g','p','m','d'))
+        continue;
+
+      for(int i = 0; i < index_size(st); i++)
+      {
+        const AVIndexEntry *e = index_entry(st, i);
+        payload_t p = {e->pos, static_cast<uint32_t>(std::max(e->size, 0))};
+        _payloads.push_back(p);
+      }
+      if(_payloads.empty())
+        continue;
+
+      _fmt = fmt;
+      DEBUG("Found %lu GPMF payloads in stream %u\n", _payloads.size(), s);
+      return true;
+    }
+
+    return false;
+  }
+
+  void av_gpmf_source::clear()
+  {
+    _fmt = NULL;
+    _payloads.clear();
+  }
+
+  uint32_t av_gpmf_source::payloads()
+  {
+    return _payloads.size();
+  }
+
+  uint32_t av_gpmf_source::payload_size(uint32_t index)
+  {
+    return index < _payloads.size() ? _payloads[index].size : 0;
+  }
+
+  std::shared_ptr<uint32_t> av_gpmf_source::payload(uint32_t index, uint32_t& size)
+  {
+    std::shared_ptr<uint32_t> data;
+    if(_fmt == NULL || index >= _payloads.size())
+      return data;
+
+    // the demuxer seeks to every packet it reads, so reading in between
+    // doesn't move it
+    const payload_t& p = _payloads[index];
+    data.reset(new uint32_t[(p.size + 3) / 4], std::default_delete<uint32_t[]>());
+    std::lock_guard<std::mutex> lock(_io);
+    if(avio_seek(_fmt->pb, p.pos, SEEK_SET) != p.pos ||
+       avio_read(_fmt->pb, reinterpret_cast<unsigned char*>(data.get()), p.size) !=
+         static_cast<int>(p.size))
+    {
+      DEBUG("Can't read GPMF payload %u at %ld\n", index, p.pos);
+      data.reset();
+      return data;
+    }
+    size = p.size;
+    return data;
+  }
+
+  av_decoder::av_decoder(bool verbose):frame_decoder(verbose),
+                                       _fmt(NULL),_codec(NULL),_frame(NULL),
+                                       _next(NULL),_pkt(NULL),_sws(NULL),_stream(-1),
+                                       _time_base(0),_start_pts(0),
+                                       _frame_pts(AV_NOPTS_VALUE),_frame_num(-1),
+                                       _frame_ticks(1),_draining(false),
+                                       _gpmf(_io, verbose),_has_gpmf(false)
+  {
+  }
+
+  av_decoder::~av_decoder()
+  {
+    close();
+  }
+
+  int32_t av_decoder::open(const std::string& in)
+  {
+    close();
+
+    if(avformat_open_input(&_fmt, in.c_str(), NULL, NULL) < 0)
+    {
+      DEBUG("Can not open %s with libavformat. Exiting...\n",in.c_str());
+      return EXTR_CANT_LOAD_VIDEO;
+    }
+    if(avformat_find_stream_info(_fmt, NULL) < 0)
+    {
+      DEBUG("Can not find stream info in %s. Exiting...\n",in.c_str());
+      close();
+      return EXTR_CANT_LOAD_VIDEO;
+    }
+    if(_index.load(in))
+    {
+      DEBUG("Can not index the frames of %s. Exiting...\n",in.c_str());
+      close();
+      return EXTR_CANT_LOAD_VIDEO;
+    }
+
+    // video track (the gpmf track is a data stream, which we don't decode)
+    _stream = av_find_best_stream(_fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    const AVCodec *codec = NULL;
+    if(_stream >= 0)
+      codec = avcodec_find_decoder(_fmt->streams[_stream]->codecpar->codec_id);
+    if(codec == NULL)
+    {
+      DEBUG("No decodable video stream in %s. Exiting...\n",in.c_str());
+      close();
+      return EXTR_CANT_LOAD_VIDEO;
+    }
+    AVStream *st = _fmt->streams[_stream];
+
+    // the GPMF payloads from the index the demuxer built, instead of reading
+    // the file again
+    _has_gpmf = _gpmf.load(_fmt);
+
+    // drop everything that is not the video track in the demuxer
+    for(unsigned int i = 0; i < _fmt->nb_streams; i++)
+    {
+      if(static_cast<int>(i) != _stream)
+        _fmt->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    _codec = avcodec_alloc_context3(codec);
+    if(_codec == NULL || avcodec_parameters_to_context(_codec, st->codecpar) < 0)
+    {
+      close();
+      return EXTR_CANT_LOAD_VIDEO;
+    }
+
+    // decode on all cores, frame and slice parallel
+    _codec->thread_count = std::thread::hardware_concurrency();
+    _codec->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if(avcodec_open2(_codec, codec, NULL) < 0)
+    {
+      DEBUG("Can not open decoder for %s. Exiting...\n",in.c_str());
+      close();
+      return EXTR_CANT_LOAD_VIDEO;
+    }
+    DEBUG("Opened libav decoder %s with %d threads...\n",codec->name,_codec->thread_count);
+
+    _frame = av_frame_alloc();
+    _next = av_frame_alloc();
+    _pkt = av_packet_alloc();
+    if(_frame == NULL || _next == NULL || _pkt == NULL)
+    {
+      close();
+      return EXTR_ERROR;
+    }
+
+    // timing
+    _time_base = av_q2d(st->time_base);
+    _start_pts = st->start_time == AV_NOPTS_VALUE ? 0 : st->start_time;
+    AVRational rate = av_guess_frame_rate(_fmt, st, NULL);
+    _fps = rate.num > 0 && rate.den > 0 ? static_cast<float>(av_q2d(rate)) : 0;
+    DEBUG("Fps is %f for video.\n",_fps);
+    _frame_ticks = _fps > 0 ? static_cast<int64_t>(1.0 / (_fps * _time_base) + 0.5) : 1;
+    if(_frame_ticks < 1)
+      _frame_ticks = 1;
+    _duration = _index.duration();
+    DEBUG("Duration of video is %f.\n",_duration);
+
+    _frame_pts = AV_NOPTS_VALUE;
+    _frame_num = -1;
+    _draining = false;
+
+    return EXTR_OK;
+  }
+
+  void av_decoder::close()
+  {
+    if(_sws)
+      sws_freeContext(_sws);
+    _sws = NULL;
+    av_packet_free(&_pkt);
+    av_frame_free(&_frame);
+    av_frame_free(&_next);
+    avcodec_free_context(&_codec);
+    _gpmf.clear();
+    _has_gpmf = false;
+    avformat_close_input(&_fmt);
+    _stream = -1;
+    _index.clear();
+    _frame_pts = AV_NOPTS_VALUE;
+    _frame_num = -1;
+  }
+
+  gpmf_source::source* av_decoder::gpmf()
+  {
+    return _has_gpmf ? &_gpmf : NULL;
+  }
+
+  int32_t av_decoder::decode_next()
+  {
+    while(true)
+    {
+      // receive into a scratch frame, so that _frame survives the end
+      int ret = avcodec_receive_frame(_codec, _next);
+      if(ret == 0)
+      {
+        av_frame_unref(_frame);
+        av_frame_move_ref(_frame, _next);
+        _frame_pts = _frame->best_effort_timestamp;
+        if(_frame_pts == AV_NOPTS_VALUE)
+          _frame_pts = _frame->pts;
+        return EXTR_OK;
+      }
+      if(ret == AVERROR_EOF)
+        return EXTR_CANT_FRAME_OUT_OF_BOUNDS;
+      if(ret != AVERROR(EAGAIN) || _draining)
+        return EXTR_ERROR;
+
+      // decoder wants more input
+      {
+        std::lock_guard<std::mutex> lock(_io);
+        ret = av_read_frame(_fmt, _pkt);
+      }
+      if(ret < 0)
+      {
+        // end of file, get the frames still in the decoder
+        _draining = true;
+        avcodec_send_packet(_codec, NULL);
+        continue;
+      }
+      if(_pkt->stream_index == _stream)
+        ret = avcodec_send_packet(_codec, _pkt);
+      av_packet_unref(_pkt);
+      if(ret < 0 && ret != AVERROR(EAGAIN))
+        return EXTR_ERROR;
+    }
+  }
+
+  int32_t av_decoder::read(float ts, cv::Mat& frame, float& real_ts)
+  {
+    if(_fmt == NULL)
+      return EXTR_CANT_LOAD_VIDEO;
+
+    // exact pts of the frame shown closest to ts
+    int64_t num = _index.frame_at(ts);
+    int64_t target = _start_pts + static_cast<int64_t>(_index.pts(num) / _time_base + 0.5);
+    int64_t half = _frame_ticks / 2;
+
+    // same as with opencv: keep decoding forward while there is no keyframe
+    // in between, and seek to the keyframe before the target otherwise
+    if(_frame_num < 0 || num < _frame_num || static_cast<int64_t>(_index.keyframe(num)) > _frame_num)
+    {
+      DEBUG("Seeking to pts %ld (frame %ld)\n",target,num);
+      {
+        std::lock_guard<std::mutex> lock(_io);
+        if(av_seek_frame(_fmt, _stream, target, AVSEEK_FLAG_BACKWARD) < 0)
+          return EXTR_ERROR;
+      }
+      avcodec_flush_buffers(_codec);
+      _frame_pts = AV_NOPTS_VALUE;
+      _frame_num = -1;
+      _draining = false;
+    }
+
+    // decode up to the frame closest to the target
+    while(_frame_pts == AV_NOPTS_VALUE || _frame_pts + half < target)
+    {
+      int32_t ret = decode_next();
+      if(ret == EXTR_CANT_FRAME_OUT_OF_BOUNDS && _frame_pts != AV_NOPTS_VALUE)
+      {
+        // past the last frame, which is the closest one
+        break;
+      }
+      else if(ret)
+      {
+        return ret;
+      }
+    }
+    real_ts = (_frame_pts - _start_pts) * _time_base;
+    _frame_num = _index.frame_at(real_ts);
+    DEBUG("Decoded frame %ld at pts %ld (%.5fs)\n",_frame_num,_frame_pts,real_ts);
+
+    // convert from the decoder format to bgr only for this frame
+    _sws = sws_getCachedContext(_sws, _frame->width, _frame->height,
+                                static_cast<AVPixelFormat>(_frame->format),
+                                _frame->width, _frame->height, AV_PIX_FMT_BGR24,
+                                SWS_BILINEAR, NULL, NULL, NULL);
+    if(_sws == NULL)
+      return EXTR_ERROR;
+    frame.create(_frame->height, _frame->width, CV_8UC3);
+    uint8_t *dst[4] = { frame.data, NULL, NULL, NULL };
+    int dst_stride[4] = { static_cast<int>(frame.step[0]), 0, 0, 0 };
+    sws_scale(_sws, _frame->data, _frame->linesize, 0, _frame->height,
+              dst, dst_stride);
+
+    return EXTR_OK;
+  }
+
+}
+
+#endif // WITH_LIBAV
@@ -0,0 +1,242 @@
+/*
+ * Exif writer
+ *
+ * Builds the APP1 Exif segment with the GPS position, speed and capture time
+ * of an image, and puts it in the encoded jpeg before it goes to disk.
+ *
+ */
+
+// class definitions
+#include "exif_writer.hpp"
+
+// basic stuff
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace exif_writer
+{
+
+  // tiff field types
+  enum
+  {
+    TYPE_BYTE = 1,
+    TYPE_ASCII = 2,
+    TYPE_LONG = 4,
+    TYPE_RATIONAL = 5,
+    TYPE_UNDEFINED = 7,
+  };
+
+  typedef struct
+  {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    std::string value; // little endian, inline in the entry if <= 4 bytes
+  }entry_t;
+
+  // entries in increasing tag order, as the spec asks
+  typedef std::vector<entry_t> ifd_t;
+
+  static void put16(std::string& s, uint16_t v)
+  {
+    s += static_cast<char>(v & 0xff);
+    s += static_cast<char>(v >> 8);
+  }
+
+  static void put32(std::string& s, uint32_t v)
+  {
+    put16(s, v & 0xffff);
+    put16(s, v >> 16);
+  }
+
+  static entry_t bytes(uint16_t tag, uint16_t type, const std::string& value)
+  {
+    entry_t e = {tag, type, static_cast<uint32_t>(value.size()), value};
+    return e;
+  }
+
+  static entry_t ascii(uint16_t tag, const std::string& text)
+  {
+    return bytes(tag, TYPE_ASCII, text + '\0');
+  }
+
+  static entry_t long_value(uint16_t tag, uint32_t v)
+  {
+    entry_t e = {tag, TYPE_LONG, 1, ""};
+    put32(e.value, v);
+    return e;
+  }
+
+  // rationals in thousandths
+  static entry_t rational(uint16_t tag, const std::vector<double>& v)
+  {
+    entry_t e = {tag, TYPE_RATIONAL, static_cast<uint32_t>(v.size()), ""};
+    for(double x:v)
+    {
+      put32(e.value, static_cast<uint32_t>(floor(x * 1000 + 0.5)));
+      put32(e.value, 1000);
+    }
+    return e;
+  }
+
+  // lat/long as degrees, minutes and seconds
+  static entry_t dms(uint16_t tag, double deg)
+  {
+    uint64_t ms = static_cast<uint64_t>(floor(fabs(deg) * 3600000 + 0.5));
+    std::vector<double> v = {static_cast<double>(ms / 3600000),
+                             static_cast<double>(ms / 60000 % 60),
+                             (ms % 60000) / 1000.0};
+    return rational(tag, v);
+  }
+
+  // bytes of the ifd with its out of line values
+  static uint32_t ifd_size(const ifd_t& ifd)
+  {
+    uint32_t size = 2 + 12 * ifd.size() + 4;
+    for(auto& e:ifd)
+      if(e.value.size() > 4)
+        size += (e.value.size() + 1) & ~1u;
+    return size;
+  }
+
+  // appends the ifd at the end of the tiff data
+  static void write_ifd(std::string& tiff, const ifd_t& ifd)
+  {
+    uint32_t data = tiff.size() + 2 + 12 * ifd.size() + 4;
+    put16(tiff, ifd.size());
+    for(auto& e:ifd)
+    {
+      put16(tiff, e.tag);
+      put16(tiff, e.type);
+      put32(tiff, e.count);
+      if(e.value.size() > 4)
+      {
+        put32(tiff, data);
+        data += (e.value.size() + 1) & ~1u;
+      }
+      else
+      {
+        tiff += e.value;
+        tiff.append(4 - e.value.size(), '\0');
+      }
+    }
+    put32(tiff, 0); // no next ifd
+
+    for(auto& e:ifd)
+    {
+      if(e.value.size() > 4)
+      {
+        tiff += e.value;
+        if(e.value.size() & 1)
+          tiff += '\0';
+      }
+    }
+  }
+
+  std::string app1_segment(const gps_tags_t& tags)
+  {
+    if(!tags.has_position && tags.utc < 0)
+      return "";
+
+    // capture time, to the millisecond
+    bool has_time = tags.utc >= 0;
+    struct tm tm;
+    int ms = 0;
+    char date[16], date_time[32], subsec[16];
+    if(has_time)
+    {
+      time_t t = static_cast<time_t>(floor(tags.utc));
+      ms = static_cast<int>(floor((tags.utc - t) * 1000 + 0.5));
+      if(ms >= 1000)
+      {
+        t++;
+        ms -= 1000;
+      }
+      gmtime_r(&t, &tm);
+      // strftime fails rather than truncate, only for years no camera records
+      if(!strftime(date, sizeof(date), "%Y:%m:%d", &tm) ||
+         !strftime(date_time, sizeof(date_time), "%Y:%m:%d %H:%M:%S", &tm))
+        has_time = false;
+      snprintf(subsec, sizeof(subsec), "%03d", ms);
+    }
+
+    ifd_t exif, gps;
+    gps.push_back(bytes(0x0000, TYPE_BYTE, std::string("\x02\x03\x00\x00", 4))); // GPSVersionID
+    if(tags.has_position)
+    {
+      gps.push_back(ascii(0x0001, tags.lat < 0 ? "S" : "N")); // GPSLatitudeRef
+      gps.push_back(dms(0x0002, tags.lat)); // GPSLatitude
+      gps.push_back(ascii(0x0003, tags.lon < 0 ? "W" : "E")); // GPSLongitudeRef
+      gps.push_back(dms(0x0004, tags.lon)); // GPSLongitude
+      gps.push_back(bytes(0x0005, TYPE_BYTE, std::string(1, tags.alt < 0 ? '\1' : '\0'))); // GPSAltitudeRef
+      gps.push_back(rational(0x0006, {fabs(tags.alt)})); // GPSAltitude
+    }
+    if(has_time)
+    {
+      gps.push_back(rational(0x0007, {static_cast<double>(tm.tm_hour),
+                                      static_cast<double>(tm.tm_min),
+                                      tm.tm_sec + ms / 1000.0})); // GPSTimeStamp
+    }
+    if(tags.has_position)
+    {
+      gps.push_back(ascii(0x000c, "K")); // GPSSpeedRef, km/h
+      gps.push_back(rational(0x000d, {tags.speed * 3.6})); // GPSSpeed
+      gps.push_back(ascii(0x0012, "WGS-84")); // GPSMapDatum
+    }
+    if(has_time)
+    {
+      gps.push_back(ascii(0x001d, date)); // GPSDateStamp
+
+      // the gps clock is utc, so the image time is too
+      exif.push_back(bytes(0x9000, TYPE_UNDEFINED, "0231")); // ExifVersion
+      exif.push_back(ascii(0x9003, date_time)); // DateTimeOriginal
+      exif.push_back(ascii(0x9011, "+00:00")); // OffsetTimeOriginal
+      exif.push_back(ascii(0x9291, subsec)); // SubSecTimeOriginal
+    }
+
+    // tiff header, then ifd0 pointing to the exif and gps ifds that follow it
+    ifd_t ifd0;
+    uint32_t offset = 8 + 2 + 12 * (exif.empty() ? 1 : 2) + 4;
+    if(!exif.empty())
+    {
+      ifd0.push_back(long_value(0x8769, offset)); // ExifIFDPointer
+      offset += ifd_size(exif);
+    }
+    ifd0.push_back(long_value(0x8825, offset)); // GPSInfoIFDPointer
+
+    std::string tiff("II*\0", 4);
+    put32(tiff, 8);
+    write_ifd(tiff, ifd0);
+    if(!exif.empty())
+      write_ifd(tiff, exif);
+    write_ifd(tiff, gps);
+
+    uint32_t length = 2 + 6 + tiff.size();
+    if(length > 0xffff)
+      return "";
+    std::string segment("\xff\xe1", 2);
+    segment += static_cast<char>(length >> 8);
+    segment += static_cast<char>(length & 0xff);
+    segment.append("Exif\0\0", 6);
+    segment += tiff;
+    return segment;
+  }
+
+  bool insert_app1(std::vector<unsigned char>& jpeg, const std::string& segment)
+  {
+    if(jpeg.size() < 4 || jpeg[0] != 0xff || jpeg[1] != 0xd8)
+      return false;
+
+    // after SOI, and after the JFIF APP0 that has to come first
+    size_t pos = 2;
+    if(jpeg[pos] == 0xff && jpeg[pos + 1] == 0xe0 && pos + 4 <= jpeg.size())
+      pos += 2 + (jpeg[pos + 2] << 8 | jpeg[pos + 3]);
+    if(pos > jpeg.size())
+      return false;
+
+    jpeg.insert(jpeg.begin() + pos, segment.begin(), segment.end());
+    return true;
+  }
+
+}
@@ -0,0 +1,169 @@
+/*
+ * Frame decoders
+ *
+ * Backend selection and the cv::VideoCapture backend.
+ *
+ */
+
+// class definitions
+#include "frame_decoder.hpp"
+
+namespace mp4_img_extractor
+{
+
+  bool parse_backend(const std::string& name, BACKEND& backend)
+  {
+    if(name == "opencv")
+      backend = BACKEND_OPENCV;
+    else if(name == "libav")
+      backend = BACKEND_LIBAV;
+    else
+      return false;
+    return true;
+  }
+
+  bool backend_available(BACKEND backend)
+  {
+#ifdef WITH_LIBAV
+    return backend == BACKEND_OPENCV || backend == BACKEND_LIBAV;
+#else
+    return backend == BACKEND_OPENCV;
+#endif
+  }
+
+  frame_decoder* create_decoder(BACKEND backend, bool verbose)
+  {
+    switch(backend)
+    {
+      case BACKEND_OPENCV:
+        return new cv_decoder(verbose);
+#ifdef WITH_LIBAV
+      case BACKEND_LIBAV:
+        return new av_decoder(verbose);
+#endif
+      default:
+        return NULL;
+    }
+  }
+
+  cv_decoder::cv_decoder(bool verbose):frame_decoder(verbose),_next_frame(-1)
+  {
+  }
+
+  int32_t cv_decoder::open(const std::string& in)
+  {
+    _cap.release();
+    _cap = cv::VideoCapture(in);
+    if(!_cap.isOpened())
+    {
+      // error!
+      DEBUG("Can not load video. Exiting...\n");
+      return EXTR_CANT_LOAD_VIDEO;
+    }
+    else
+    {
+      // Success!
+      DEBUG("Opened cv capture successfully...\n");
+    }
+
+    _fps = _cap.get(CV_CAP_PROP_FPS);
+    DEBUG("Fps is %f for video.\n",_fps);
+
+    // exact frame times, to know where the capture is without asking it
+    if(_index.load(in) == EXTR_OK)
+    {
+      DEBUG("There are %lu frames in the video.\n",_index.frames());
+      _duration = _index.duration();
+    }
+    else
+    {
+      // fragmented or odd mp4s without a sample table we can read: seek by
+      // time, and ask the capture where it landed
+      float frames = _cap.get(CV_CAP_PROP_FRAME_COUNT);
+      DEBUG("Can not index the frames of the video, seeking by time in its %f frames.\n",frames);
+      _duration = _fps > 0 ? frames / _fps : 0;
+    }
+    DEBUG("Duration of video is %f.\n",_duration);
+
+    // we don't know where the capture is until the first seek
+    _next_frame = -1;
+
+    return EXTR_OK;
+  }
+
+  void cv_decoder::close()
+  {
+    _cap.release();
+    _index.clear();
+    _next_frame = -1;
+  }
+
+  int32_t cv_decoder::read(float ts, cv::Mat& frame, float& real_ts)
+  {
+    if(_index.frames() == 0)
+      return read_by_time(ts, frame, real_ts);
+
+    // frame shown closest to the timestamp, and the keyframe it decodes from
+    int64_t target = _index.frame_at(ts);
+    int64_t key = _index.keyframe(target);
+    real_ts = _index.pts(target);
+
+    // keep decoding forward while there is no keyframe in between (a seek
+    // would decode the same frames), and seek to the keyframe otherwise
+    if(_next_frame >= 0 && target >= _next_frame && key <= _next_frame)
+    {
+      DEBUG("Decoding forward from frame %ld to %ld\n",_next_frame,target);
+    }
+    else
+    {
+      DEBUG("Seeking to keyframe %ld for frame %ld\n",key,target);
+      _cap.set(CV_CAP_PROP_POS_FRAMES,key);
+      _next_frame = key;
+    }
+    while(_next_frame < target && _cap.grab())
+      _next_frame++;
+
+    // get frame
+    _cap >> frame;
+    _next_frame++;
+    DEBUG("Real timestamp set to %.5f\n",real_ts);
+
+    if(frame.empty() || _next_frame != target + 1)
+    {
+      std::cerr << "Skipping frame at " << real_ts << "s." << std::endl;
+      _next_frame = -1; // seek next time
+      return EXTR_SKIPPING_FRAME;
+    }
+
+    return EXTR_OK;
+  }
+
+  int32_t cv_decoder::read_by_time(float ts, cv::Mat& frame, float& real_ts)
+  {
+    // opencv works in ms
+    _cap.set(CV_CAP_PROP_POS_MSEC,ts * 1000);
+    real_ts = _cap.get(CV_CAP_PROP_POS_MSEC) / 1000;
+    DEBUG("Real timestamp set to %.5f\n",real_ts);
+    _cap >> frame;
+
+    // if frame was not captured, try again n times
+    int tries=1;
+    while(frame.empty() && tries<=50)
+    {
+      DEBUG("Frame skipped trying again for %d time: Real timestamp set to %.5f\n",tries,real_ts);
+      real_ts = _cap.get(CV_CAP_PROP_POS_MSEC) / 1000;
+      _cap >> frame;
+      tries++;
+    }
+
+    // 50 times is an exaggeration, if it still didn't work, something is wrong
+    if(frame.empty())
+    {
+      std::cerr << "Skipping frame at " << real_ts << "s." << std::endl;
+      return EXTR_SKIPPING_FRAME;
+    }
+
+    return EXTR_OK;
+  }
+
+}
@@ -0,0 +1,298 @@
+/*
+ * Frame index
+ *
+ * Reads the sample table of the video track of an mp4 into exact frame
+ * timestamps and keyframes.
+ *
+ */
+
+// class definitions
+#include "frame_index.hpp"
+
+// return codes
+#include "frame_decoder.hpp"
+
+// basic stuff
+#include <stdio.h>
+#include <algorithm>
+
+namespace mp4_img_extractor
+{
+
+  static uint32_t be32(const uint8_t *p)
+  {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+  }
+
+  static uint64_t be64(const uint8_t *p)
+  {
+    return (uint64_t(be32(p)) << 32) | be32(p + 4);
+  }
+
+  static uint32_t fourcc(const char *s)
+  {
+    return be32(reinterpret_cast<const uint8_t*>(s));
+  }
+
+  // box in a buffer: its type and body
+  typedef struct
+  {
+    uint32_t type;
+    const uint8_t *body;
+    const uint8_t *end;
+  }box_t;
+
+  // next box in [p, end), advancing p. False at the end or if it is broken.
+  static bool next_box(const uint8_t *&p, const uint8_t *end, box_t& box)
+  {
+    if(end - p < 8)
+      return false;
+    uint64_t size = be32(p);
+    box.type = be32(p + 4);
+    box.body = p + 8;
+    if(size == 1)
+    {
+      if(end - p < 16)
+        return false;
+      size = be64(p + 8);
+      box.body = p + 16;
+    }
+    else if(size == 0)
+    {
+      size = end - p; // up to the end
+    }
+    if(size < static_cast<uint64_t>(box.body - p) || size > static_cast<uint64_t>(end - p))
+      return false;
+    box.end = p + size;
+    p = box.end;
+    return true;
+  }
+
+  // first child of the given type, following the path of types
+  static bool find_box(const uint8_t *p, const uint8_t *end, const char *const *path,
+                       box_t& box)
+  {
+    for(; *path; path++)
+    {
+      bool found = false;
+      while(!found && next_box(p, end, box))
+        found = box.type == fourcc(*path);
+      if(!found)
+        return false;
+      p = box.body;
+      end = box.end;
+    }
+    return true;
+  }
+
+  // reads the whole moov box of the file
+  static bool read_moov(const std::string& in, std::vector<uint8_t>& moov)
+  {
+    FILE *f = fopen(in.c_str(), "rb");
+    if(f == NULL)
+      return false;
+
+    bool ok = false;
+    uint8_t header[16];
+    while(fread(header, 1, 8, f) == 8)
+    {
+      uint64_t size = be32(header);
+      uint64_t header_size = 8;
+      if(size == 1)
+      {
+        if(fread(header + 8, 1, 8, f) != 8)
+          break;
+        size = be64(header + 8);
+        header_size = 16;
+      }
+      if(size != 0 && size < header_size)
+        break;
+
+      if(be32(header + 4) == fourcc("moov"))
+      {
+        if(size == 0)
+          break; // moov is never the open ended last box
+        moov.resize(size - header_size);
+        ok = fread(moov.data(), 1, moov.size(), f) == moov.size();
+        break;
+      }
+      if(size == 0 || fseeko(f, size - header_size, SEEK_CUR) != 0)
+        break;
+    }
+    fclose(f);
+    return ok;
+  }
+
+  frame_index::frame_index(bool verbose):_verbose(verbose),_duration(0)
+  {
+  }
+
+  void frame_index::clear()
+  {
+    _pts.clear();
+    _key.clear();
+    _duration = 0;
+  }
+
+  int32_t frame_index::load(const std::string& in)
+  {
+    clear();
+
+    std::vector<uint8_t> moov;
+    if(!read_moov(in, moov))
+    {
+      DEBUG("No moov box in %s\n", in.c_str());
+      return EXTR_CANT_LOAD_VIDEO;
+    }
+
+    // first video track (the gpmf one is a metadata track)
+    const uint8_t *p = moov.data(), *end = p + moov.size();
+    static const char *const hdlr_path[] = {"mdia", "hdlr", NULL};
+    static const char *const mdhd_path[] = {"mdia", "mdhd", NULL};
+    static const char *const elst_path[] = {"edts", "elst", NULL};
+    static const char *const stbl_path[] = {"mdia", "minf", "stbl", NULL};
+    box_t trak, hdlr, mdhd, elst, stbl;
+    bool found = false;
+    while(!found && next_box(p, end, trak))
+    {
+      found = trak.type == fourcc("trak") &&
+              find_box(trak.body, trak.end, hdlr_path, hdlr) &&
+              hdlr.end - hdlr.body >= 12 && be32(hdlr.body + 8) == fourcc("vide");
+    }
+    if(!found || !find_box(trak.body, trak.end, mdhd_path, mdhd) ||
+       !find_box(trak.body, trak.end, stbl_path, stbl))
+    {
+      DEBUG("No video track in %s\n", in.c_str());
+      return EXTR_CANT_LOAD_VIDEO;
+    }
+
+    // media timescale (ticks per second)
+    bool v1 = mdhd.body[0] == 1;
+    if(mdhd.end - mdhd.body < (v1 ? 24 : 16))
+      return EXTR_CANT_LOAD_VIDEO;
+    uint32_t timescale = be32(mdhd.body + (v1 ? 20 : 12));
+    if(timescale == 0)
+      return EXTR_CANT_LOAD_VIDEO;
+
+    // media time the presentation starts at (first edit that isn't empty)
+    int64_t media_start = 0;
+    if(find_box(trak.body, trak.end, elst_path, elst) && elst.end - elst.body >= 8)
+    {
+      v1 = elst.body[0] == 1;
+      uint32_t entries = be32(elst.body + 4);
+      uint32_t entry_size = v1 ? 20 : 12;
+      const uint8_t *e = elst.body + 8;
+      for(uint32_t i = 0; i < entries && elst.end - e >= entry_size; i++, e += entry_size)
+      {
+        int64_t media_time = v1 ? static_cast<int64_t>(be64(e + 8))
+                                : static_cast<int32_t>(be32(e + 4));
+        if(media_time >= 0)
+        {
+          media_start = media_time;
+          break;
+        }
+      }
+    }
+
+    // sample table: decode times, composition offsets and sync samples
+    box_t stts, ctts, stss;
+    const uint8_t *q = stbl.body;
+    bool has_stts = false, has_ctts = false, has_stss = false;
+    box_t box;
+    while(next_box(q, stbl.end, box))
+    {
+      if(box.type == fourcc("stts")) { stts = box; has_stts = true; }
+      else if(box.type == fourcc("ctts")) { ctts = box; has_ctts = true; }
+      else if(box.type == fourcc("stss")) { stss = box; has_stss = true; }
+    }
+    if(!has_stts || stts.end - stts.body < 8)
+    {
+      DEBUG("No sample table in %s (fragmented?)\n", in.c_str());
+      return EXTR_CANT_LOAD_VIDEO;
+    }
+
+    // decode order: pts and sync flag of every sample
+    std::vector<int64_t> pts;
+    std::vector<char> sync;
+    int64_t dts = 0, last_delta = 0;
+    uint32_t entries = be32(stts.body + 4);
+    const uint8_t *e = stts.body + 8;
+    for(uint32_t i = 0; i < entries && stts.end - e >= 8; i++, e += 8)
+    {
+      uint32_t count = be32(e), delta = be32(e + 4);
+      for(uint32_t j = 0; j < count; j++, dts += delta)
+        pts.push_back(dts - media_start);
+      last_delta = delta;
+    }
+    if(pts.empty())
+      return EXTR_CANT_LOAD_VIDEO;
+
+    if(has_ctts && ctts.end - ctts.body >= 8)
+    {
+      // offsets are signed in version 1, and in practice in version 0 too
+      size_t s = 0;
+      entries = be32(ctts.body + 4);
+      e = ctts.body + 8;
+      for(uint32_t i = 0; i < entries && ctts.end - e >= 8; i++, e += 8)
+      {
+        uint32_t count = be32(e);
+        int32_t offset = static_cast<int32_t>(be32(e + 4));
+        for(uint32_t j = 0; j < count && s < pts.size(); j++)
+          pts[s++] += offset;
+      }
+    }
+
+    // without stss every sample is a sync sample
+    sync.assign(pts.size(), !has_stss);
+    if(has_stss && stss.end - stss.body >= 8)
+    {
+      entries = be32(stss.body + 4);
+      e = stss.body + 8;
+      for(uint32_t i = 0; i < entries && stss.end - e >= 4; i++, e += 4)
+      {
+        uint32_t sample = be32(e); // 1 based
+        if(sample >= 1 && sample <= pts.size())
+          sync[sample - 1] = true;
+      }
+    }
+
+    // presentation order. A frame decodes from the last keyframe shown before
+    // it (or itself).
+    std::vector<uint32_t> order(pts.size());
+    for(uint32_t i = 0; i < order.size(); i++)
+      order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+                     [&](uint32_t a, uint32_t b){ return pts[a] < pts[b]; });
+    _pts.resize(order.size());
+    _key.resize(order.size());
+    uint32_t key = 0;
+    for(uint32_t i = 0; i < order.size(); i++)
+    {
+      if(sync[order[i]])
+        key = i;
+      _pts[i] = static_cast<double>(pts[order[i]]) / timescale;
+      _key[i] = key;
+    }
+    _duration = static_cast<double>(pts[order.back()] + last_delta) / timescale;
+
+    DEBUG("Indexed %lu frames (%ld keyframes) over %.5fs, timescale %u\n",
+          _pts.size(), std::count(sync.begin(), sync.end(), true), _duration, timescale);
+
+    return EXTR_OK;
+  }
+
+  size_t frame_index::frame_at(double ts) const
+  {
+    if(_pts.empty())
+      return 0;
+
+    // first frame shown at or after ts, or the one before if it is closer
+    size_t next = std::lower_bound(_pts.begin(), _pts.end(), ts) - _pts.begin();
+    if(next == _pts.size())
+      return next - 1;
+    if(next > 0 && ts - _pts[next - 1] < _pts[next] - ts)
+      return next - 1;
+    return next;
+  }
+
+}
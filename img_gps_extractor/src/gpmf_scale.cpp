@@ -0,0 +1,192 @@
+/*
+ * GPMF scaling kernel
+ *
+ * Specialised replacement for GPMF_ScaledData for the common GoPro sample
+ * layout (big endian int16 or int32 elements with a SCAL per element or one
+ * for all). Byte swaps, converts and scales with SIMD, writing the floats
+ * straight into the destination buffer.
+ *
+ */
+
+// class definitions
+#include "gpmf_scale.hpp"
+
+// simd
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace gpmf_scale
+{
+
+  // values per simd iteration
+  static const uint32_t LANES = 8;
+
+  static inline int16_t be16(const uint8_t *p)
+  {
+    return static_cast<int16_t>((p[0] << 8) | p[1]);
+  }
+
+  static inline int32_t be32(const uint8_t *p)
+  {
+    return static_cast<int32_t>((static_cast<uint32_t>(p[0]) << 24) |
+                                (static_cast<uint32_t>(p[1]) << 16) |
+                                (static_cast<uint32_t>(p[2]) << 8) |
+                                 static_cast<uint32_t>(p[3]));
+  }
+
+  // reads the SCAL of the current stream, one per element
+  static bool read_scale(GPMF_stream *ms, uint32_t elements, float *scale)
+  {
+    GPMF_stream find_stream;
+    GPMF_CopyState(ms, &find_stream);
+    if (GPMF_OK != GPMF_FindPrev(&find_stream, GPMF_KEY_SCALE, GPMF_CURRENT_LEVEL))
+    {
+      // no scale, values are already in their units
+      for (uint32_t i = 0; i < elements; i++)
+        scale[i] = 1.0f;
+      return true;
+    }
+
+    uint32_t type = GPMF_Type(&find_stream);
+    uint32_t count = GPMF_Repeat(&find_stream);
+    const uint8_t *data = static_cast<const uint8_t*>(GPMF_RawData(&find_stream));
+    if ((count != 1 && count != elements) || GPMF_ElementsInStruct(&find_stream) != 1)
+      return false;
+
+    for (uint32_t i = 0; i < elements; i++)
+    {
+      uint32_t j = count == 1 ? 0 : i;
+      switch (type)
+      {
+        case GPMF_TYPE_SIGNED_SHORT: scale[i] = static_cast<float>(be16(data + 2 * j)); break;
+        case GPMF_TYPE_UNSIGNED_SHORT: scale[i] = static_cast<float>(static_cast<uint16_t>(be16(data + 2 * j))); break;
+        case GPMF_TYPE_SIGNED_LONG: scale[i] = static_cast<float>(be32(data + 4 * j)); break;
+        case GPMF_TYPE_UNSIGNED_LONG: scale[i] = static_cast<float>(static_cast<uint32_t>(be32(data + 4 * j))); break;
+        default: return false;
+      }
+    }
+
+    return true;
+  }
+
+  bool scale_samples(const void *raw, uint32_t type, uint32_t samples,
+                     uint32_t elements, const float *scale, float *dst)
+  {
+    if ((type != GPMF_TYPE_SIGNED_SHORT && type != GPMF_TYPE_SIGNED_LONG) ||
+        elements == 0 || elements > MAX_ELEMENTS)
+      return false;
+
+    const uint8_t *src = static_cast<const uint8_t*>(raw);
+    const uint32_t n = samples * elements;
+    uint32_t i = 0;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    // the scale of value i is scale[i % elements]. Repeat it for LANES *
+    // elements values, so that the pattern for any block of LANES values
+    // starting at a multiple of LANES is contiguous.
+    float pattern[LANES * MAX_ELEMENTS];
+    const uint32_t period = LANES * elements;
+    for (uint32_t j = 0; j < period; j++)
+      pattern[j] = scale[j % elements];
+    uint32_t p = 0;
+#endif
+
+#if defined(__AVX2__)
+    if (type == GPMF_TYPE_SIGNED_SHORT)
+    {
+      const __m128i swap = _mm_setr_epi8(1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14);
+      for (; i + LANES <= n; i += LANES)
+      {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+        v = _mm_shuffle_epi8(v, swap);
+        __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+        _mm256_storeu_ps(dst + i, _mm256_div_ps(f, _mm256_loadu_ps(pattern + p)));
+        p = p + LANES == period ? 0 : p + LANES;
+      }
+    }
+    else
+    {
+      const __m256i swap = _mm256_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+                                            3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+      for (; i + LANES <= n; i += LANES)
+      {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 4 * i));
+        v = _mm256_shuffle_epi8(v, swap);
+        __m256 f = _mm256_cvtepi32_ps(v);
+        _mm256_storeu_ps(dst + i, _mm256_div_ps(f, _mm256_loadu_ps(pattern + p)));
+        p = p + LANES == period ? 0 : p + LANES;
+      }
+    }
+#elif defined(__SSE2__)
+    if (type == GPMF_TYPE_SIGNED_SHORT)
+    {
+      for (; i + LANES <= n; i += LANES)
+      {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        // sign extend to 32 bits
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(dst + i, _mm_div_ps(_mm_cvtepi32_ps(lo), _mm_loadu_ps(pattern + p)));
+        _mm_storeu_ps(dst + i + 4, _mm_div_ps(_mm_cvtepi32_ps(hi), _mm_loadu_ps(pattern + p + 4)));
+        p = p + LANES == period ? 0 : p + LANES;
+      }
+    }
+    else
+    {
+      for (; i + LANES <= n; i += LANES)
+      {
+        for (uint32_t h = 0; h < LANES; h += 4)
+        {
+          __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * (i + h)));
+          // swap bytes in each 16 bit half, then swap the halves
+          v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+          v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+          _mm_storeu_ps(dst + i + h, _mm_div_ps(_mm_cvtepi32_ps(v), _mm_loadu_ps(pattern + p + h)));
+        }
+        p = p + LANES == period ? 0 : p + LANES;
+      }
+    }
+#endif
+
+    // leftovers (or everything without simd)
+    if (type == GPMF_TYPE_SIGNED_SHORT)
+    {
+      for (; i < n; i++)
+        dst[i] = static_cast<float>(be16(src + 2 * i)) / scale[i % elements];
+    }
+    else
+    {
+      for (; i < n; i++)
+        dst[i] = static_cast<float>(be32(src + 4 * i)) / scale[i % elements];
+    }
+
+    return true;
+  }
+
+  GPMF_ERR scaled_data(GPMF_stream *ms, float *dst, uint32_t samples,
+                       uint32_t elements)
+  {
+    uint32_t type = GPMF_Type(ms);
+    uint32_t type_size = type == GPMF_TYPE_SIGNED_SHORT ? 2 : 4;
+    float scale[MAX_ELEMENTS];
+
+    if ((type == GPMF_TYPE_SIGNED_SHORT || type == GPMF_TYPE_SIGNED_LONG) &&
+        elements <= MAX_ELEMENTS &&
+        GPMF_StructSize(ms) == elements * type_size &&
+        samples <= GPMF_Repeat(ms) &&
+        read_scale(ms, elements, scale) &&
+        scale_samples(GPMF_RawData(ms), type, samples, elements, scale, dst))
+    {
+      return GPMF_OK;
+    }
+
+    // anything else goes through the generic parser
+    return GPMF_ScaledData(ms, dst, samples * elements * sizeof(float), 0,
+                           samples, GPMF_TYPE_FLOAT);
+  }
+
+}
@@ -0,0 +1,116 @@
+/*
+ * GPMF source
+ *
+ * The source on top of the gpmf-parser mp4 reader.
+ *
+ */
+
+// class definitions
+#include "gpmf_source.hpp"
+
+// basic stuff
+#include <string.h>
+#include <mutex>
+
+// the mp4 reader of the gpmf-parser demo
+#include "GPMF_mp4reader.h"
+
+namespace gpmf_source
+{
+
+  // the mp4 reader keeps the open file and its index in globals
+  static std::mutex mp4reader_mutex;
+
+  mp4reader_source::mp4reader_source():_open(false),_duration(0)
+  {
+  }
+
+  mp4reader_source::~mp4reader_source()
+  {
+    close();
+  }
+
+  float mp4reader_source::open(const std::string& in)
+  {
+    close();
+    std::lock_guard<std::mutex> lock(mp4reader_mutex);
+    _duration = OpenGPMFSource(const_cast<char*>(in.c_str()));
+    _open = true;
+    return _duration;
+  }
+
+  void mp4reader_source::close()
+  {
+    std::lock_guard<std::mutex> lock(mp4reader_mutex);
+    if (_open)
+      CloseGPMFSource();
+    _open = false;
+    _duration = 0;
+  }
+
+  float mp4reader_source::duration()
+  {
+    return _duration;
+  }
+
+  uint32_t mp4reader_source::payloads()
+  {
+    std::lock_guard<std::mutex> lock(mp4reader_mutex);
+    return _open ? GetNumberGPMFPayloads() : 0;
+  }
+
+  uint32_t mp4reader_source::payload_size(uint32_t index)
+  {
+    std::lock_guard<std::mutex> lock(mp4reader_mutex);
+    return _open ? GetGPMFPayloadSize(index) : 0;
+  }
+
+  std::shared_ptr<uint32_t> mp4reader_source::payload(uint32_t index, uint32_t& size)
+  {
+    std::lock_guard<std::mutex> lock(mp4reader_mutex);
+    std::shared_ptr<uint32_t> data;
+    if (!_open)
+      return data;
+    size = GetGPMFPayloadSize(index);
+    data.reset(GetGPMFPayload(NULL, index), FreeGPMFPayload);
+    return data;
+  }
+
+  bool mp4reader_source::payload_time(uint32_t index, float& in, float& out)
+  {
+    std::lock_guard<std::mutex> lock(mp4reader_mutex);
+    return _open && GetGPMFPayloadTime(index, &in, &out) == GPMF_OK;
+  }
+
+  float mp4reader_source::sample_rate_and_times(GPMF_stream *ms, uint32_t index,
+                                                float& in, float& out)
+  {
+    std::lock_guard<std::mutex> lock(mp4reader_mutex);
+    return _open ? GetGPMFSampleRateAndTimes(ms, 0.0, index, &in, &out) : 0;
+  }
+
+  // same bytes in payload index of a and b
+  static bool same_payload(source& a, source& b, uint32_t index)
+  {
+    uint32_t size_a = 0, size_b = 0;
+    std::shared_ptr<uint32_t> data_a = a.payload(index, size_a);
+    std::shared_ptr<uint32_t> data_b = b.payload(index, size_b);
+    if (!data_a || !data_b)
+      return !data_a && !data_b;
+    return size_a == size_b && memcmp(data_a.get(), data_b.get(), size_a) == 0;
+  }
+
+  bool same_payloads(source& a, source& b)
+  {
+    // both index the same samples of the same track, and read them from the
+    // same place (checked on both ends)
+    uint32_t n = a.payloads();
+    if (n != b.payloads())
+      return false;
+    for (uint32_t i = 0; i < n; i++)
+      if (a.payload_size(i) != b.payload_size(i))
+        return false;
+    return n == 0 || (same_payload(a, b, 0) && same_payload(a, b, n - 1));
+  }
+
+}
@@ -11,37 +11,201 @@
 // class definitions
 #include "gpmf_to_yaml.hpp"
 
+// simd scaling of sensor samples
+#include "gpmf_scale.hpp"
+
+// metadata text without the emitter
+#include "yaml_format.hpp"
+
 // basic stuff
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <ctype.h>
 #include <iostream> 
 #include <string> 
 #include <fstream>
+#include <limits>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 namespace gpmf_to_yaml
 {
 
+  // GPSU ("yymmddhhmmss.sss", UTC) to seconds since the epoch
+  static bool parse_gpsu(const char *data, uint32_t size, double& utc)
+  {
+    char text[32];
+    if (size < 16 || size >= sizeof(text))
+      return false;
+    memcpy(text, data, size);
+    text[size] = 0;
+
+    struct tm tm;
+    int ms;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(text, "%2d%2d%2d%2d%2d%2d.%3d", &tm.tm_year, &tm.tm_mon,
+               &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &ms) != 7)
+      return false;
+    tm.tm_year += 100; // since 1900
+    tm.tm_mon -= 1;
+    utc = timegm(&tm) + ms / 1000.0;
+    return true;
+  }
+
+  // axes of the cameras that don't write ORIN, by device name (DVNM): the
+  // HERO5 (named "Camera") stores z, x, y and the HERO6 and HERO7 y, -x, z
+  static bool model_axes(const std::string& device, sc::axes_t& axes)
+  {
+    std::string name = device;
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (name.find("hero6") != std::string::npos || name.find("hero7") != std::string::npos)
+      return sc::parse_orin("YxZ", 3, axes);
+    if (name.find("hero5") != std::string::npos || name == "camera")
+      return sc::parse_orin("ZXY", 3, axes);
+    return false;
+  }
+
+  // parses the samples of every schema in a payload, with the sensor axes
+  // reordered to the camera ones
+  struct converter::parse_visitor
+  {
+    converter& c;
+    GPMF_stream *ms;
+    uint32_t index;
+    const std::string& device;
+    payload_chunk_t& chunk;
+
+    template<class S> int32_t visit()
+    {
+      sensor_stream_t& stream = chunk.streams.get<S>();
+      size_t first = stream.ts.size();
+      int32_t ret = c.payload_to_stream(ms, S::fourcc(), index, S::elements, stream);
+      if (ret != CONV_OK || !S::camera_axes || stream.ts.size() == first)
+        return ret;
+
+      sc::axes_t axes;
+      if (!c.find_axes(ms, S::fourcc(), device, axes))
+      {
+        chunk.unknown_axes = true;
+        return CONV_OK; // left as stored
+      }
+      sc::to_camera(axes, &stream.data[first * stream.elements],
+                    stream.ts.size() - first, stream.elements);
+      return CONV_OK;
+    }
+  };
+
+  // appends the samples of a payload to the streams of the file
+  struct converter::append_visitor
+  {
+    converter& c;
+    const sensors_t::streams& from;
+    sensors_t::streams& to;
+
+    template<class S> int32_t visit()
+    {
+      return c.append_stream(from.get<S>(), to.get<S>());
+    }
+  };
+
+  // fails if a required stream has no samples
+  struct required_visitor
+  {
+    const sensors_t::streams& streams;
+
+    template<class S> int32_t visit()
+    {
+      if(S::required && streams.get<S>().ts.empty())
+      {
+        std::cerr << "No " << S::key() << " data to interpolate images from." << std::endl;
+        return CONV_NO_PAYLOAD;
+      }
+      return CONV_OK;
+    }
+  };
+
+  // values of every stream at an image: the samples right before and right
+  // after its timestamp, interpolated following the schema. The first and
+  // last images may not have 2 samples around them, so they take the
+  // closest one.
+  struct interp_visitor
+  {
+    const sensors_t::streams& streams;
+    float ts;
+    sensors_t::records& records;
+    bool _verbose;
+
+    template<class S> int32_t visit()
+    {
+      sc::record<S>& r = records.get<S>();
+      sc::interpolate(streams.get<S>(), ts, r);
+      for(uint32_t i = 0; r.valid && i < S::elements; i++)
+        DEBUG("  Interpolated %s %s: %.10f.\n",S::key(),S::name(i),r.v[i]);
+      return CONV_OK;
+    }
+  };
+
+  // yaml of every stream of an image
+  struct format_visitor
+  {
+    std::string& text;
+    const sensors_t::records& records;
+
+    template<class S> int32_t visit()
+    {
+      sc::format(text, records.get<S>());
+      return CONV_OK;
+    }
+  };
+
   converter::converter(bool verbose):_extractor()
   {
     // init some members
     _ms = &_metadata_stream;
     _payload = NULL;
     _verbose = verbose; //verbose is false by default
+    _start = 0;
+    _end = -1;
+    _min_fix = 0;
+    _max_precision = 0;
+    _gated = false;
+    _fix_samples = 0;
+    _parsed = false;
+    _merged_in = 0;
+    _axes_warned = false;
+    _source = NULL;
+    rate_t rate = {1, "", 0}; // 1Hz until init
+    _rates.push_back(rate);
   }
 
   converter::converter(const std::string& in,
                        const std::string& out_dir, 
                        const float fr,
                        bool verbose):_input(in),_output_dir(out_dir),
-                                     _fr(fr),_verbose(verbose),
+                                     _rates(1, rate_t{fr, "", 0}),_verbose(verbose),
                                      _extractor(_input,_output_dir,verbose)
 
   {
     // init some members
     _ms = &_metadata_stream;
     _payload = NULL;
+    _start = 0;
+    _end = -1;
+    _min_fix = 0;
+    _max_precision = 0;
+    _gated = false;
+    _fix_samples = 0;
+    _parsed = false;
+    _merged_in = 0;
+    _axes_warned = false;
+    _source = NULL;
   }
 
   int32_t converter::init()
@@ -49,18 +213,6 @@ namespace gpmf_to_yaml
     // init some members
     _ms = &_metadata_stream;
     _payload = NULL;
-    _metadatalength = OpenGPMFSource(const_cast<char*>(_input.c_str()));
-    if(_metadatalength > 0.0)
-    {
-      uint32_t index, payloads = GetNumberGPMFPayloads();
-      std::cout << "Found " << _metadatalength << "s of metadata, from " 
-                << payloads << " payloads, within " << _input << std::endl;
-    }
-    else
-    {
-      std::cerr << "Found no payload. Exiting..." << std::endl;
-      return CONV_NO_PAYLOAD;
-    }
 
     // init the frame extractor
     int ret = _extractor.init();
@@ -74,6 +226,32 @@ namespace gpmf_to_yaml
       std::cout << "Done opening video with opencv! Ready to extract frames" << std::endl;
     }
 
+    // payload and sample times from the mp4 reader, whatever the decoder.
+    // The payloads themselves through the decoder's demuxer when it has the
+    // same ones open, so they aren't read through a second file.
+    _metadatalength = _reader.open(_input);
+    _source = &_reader;
+    gpmf_source::source *demuxed = _extractor.gpmf();
+    if(demuxed && gpmf_source::same_payloads(*demuxed, _reader))
+    {
+      _source = demuxed;
+    }
+    else if(demuxed)
+    {
+      DEBUG("The demuxer's GPMF payloads differ from the mp4 reader's, reading them with it\n");
+    }
+    if(_metadatalength > 0.0)
+    {
+      uint32_t payloads = _reader.payloads();
+      std::cout << "Found " << _metadatalength << "s of metadata, from " 
+                << payloads << " payloads, within " << _input << std::endl;
+    }
+    else
+    {
+      std::cerr << "Found no payload. Exiting..." << std::endl;
+      return CONV_NO_PAYLOAD;
+    }
+
     return CONV_OK;
   }
 
@@ -82,12 +260,32 @@ namespace gpmf_to_yaml
                           const float fr,
                           const uint32_t idx_offset)
   {
-    // reload args into members
+    rate_t rate = {fr, "", idx_offset};
+    return init(in, out_dir, std::vector<rate_t>(1, rate));
+  }
+
+  int32_t converter::init(const std::string& in,
+                          const std::string& out_dir,
+                          const std::vector<rate_t>& rates)
+  {
+    if(rates.empty())
+      return CONV_ERROR;
+
+    // nothing of a previous file survives, even if its run failed before
+    // cleaning up
+    cleanup();
+
+    // reload args into members. Images of every rate go to its own output
+    // of the extractor.
     _input = in;
     _output_dir = out_dir;
-    _fr = fr;
+    _rates = rates;
+    _sensor_frames.resize(_rates.size());
+    std::vector<std::string> dirs;
+    for(auto& r:_rates)
+      dirs.push_back(r.dir);
+    _extractor.set_outputs(dirs);
     _extractor.init(_input,_output_dir);
-    _idx_offset = idx_offset;
     
     // init
     int ret = init();
@@ -95,426 +293,1010 @@ namespace gpmf_to_yaml
     return ret;
   }
 
-  int32_t converter::run(YAML::Emitter & out)
+  int32_t converter::run(md_wr::writer & out)
+  {
+    return run(std::vector<md_wr::writer*>(1, &out));
+  }
+
+  int32_t converter::run(const std::vector<md_wr::writer*>& out)
   {
     int32_t ret = CONV_OK;
+
+    // one metadata file per rate
+    if(out.size() != _rates.size())
+      return CONV_ERROR;
     
     /*
      * Our intention is to sub-sample at a specific frame rate, so 
-     * we will:
-     *  - Loop our log and extract all meta-data (different frequencies).
+     * we will, as a pipeline where every stage works at the same time and
+     * feeds the next one through a bounded queue:
+     *  - Parse the meta-data (different frequencies) payload by payload, on
+     *    all cores, running a few payloads ahead of the images.
      *  - Loop with our frame-rate extract still images. This involves creating
-     *    a folder and putting every image there with a certain name.
-     *  - Interpolate sensor info for each still image time-stamp
-     *  - Save the interpolated data with the image to a structure
-     *  - Save every structure in the yaml file to create database. It should
-     *    also contain the original file name and the frame rate at the
-     *    beginning of the yaml file.
+     *    a folder and putting every image there with a certain name. Before
+     *    each image, merge the payloads up to its time, and interpolate the
+     *    sensor info for its time-stamp into a structure.
+     *  - Save every structure in the yaml file to create database as soon as
+     *    it is ready. It should also contain the original file name and the
+     *    frame rate at the beginning of the yaml file.
      */
+    _parsed = false;
+    _merged_in = -std::numeric_limits<float>::max();
+    _fix.clear();
+    _fix_samples = 0;
+    _gated = false;
+    _axes_warned = false;
+
+    chunk_queue_t chunks(2 * std::max(1u, std::thread::hardware_concurrency()));
+    entry_queue_t entries(64);
+
+    std::cout << "Parsing GPMF data, sampling images at desired framerate and "
+                 "creating metadata yaml dict..." << std::endl;
+
+    // parse stage
+    int32_t parse_ret = CONV_OK;
+    std::thread parser([&]()
+    {
+      parse_ret = gpmf_to_maps(chunks);
+      chunks.close();
+    });
 
-    // extract all metadata to maps
-    std::cout << "Parsing GPMF data..." << std::endl;
-    ret = gpmf_to_maps();
-    if(ret)
+    // write stage
+    int32_t write_ret = CONV_OK;
+    std::thread writer([&]()
+    {
+      write_ret = sensorframes_to_yaml(entries, out);
+      entries.close(); // stops the images on error
+    });
+
+    // frame stage, in this thread. Closing the queues when done (or on
+    // error) lets the other stages finish.
+    ret = populate_images(chunks, entries);
+    chunks.close();
+    entries.close();
+    parser.join();
+    writer.join();
+
+    if(parse_ret)
     {
       std::cout << "Error parsing GPMF data. Exiting..." << std::endl;
-      return ret;
+      cleanup();
+      return parse_ret;
     }
-    else
+    if(write_ret)
     {
-      std::cout << "Done parsing GPMF data." << std::endl << std::endl ;
+      std::cout << "Error creating metadata yaml dict. Exiting..." << std::endl;
+      return write_ret;
     }
-
-    // sample images at desired framerate
-    std::cout << "Sampling images at desired framerate..." << std::endl;
-    ret = populate_images();
     if(ret)
     {
       std::cout << "Error populating images. Exiting..." << std::endl;
       return ret;
     }
-    else
-    {
-      std::cout << "Done sampling images at desired framerate." << std::endl << std::endl ;
-    }
 
-    // interpolate sensor metadata to adjust to image sampling rate
-    std::cout << "Interpolating sensors and populating sensor frames..." << std::endl;
-    ret = sensors_to_sensorframes();
+    // only happens if there are images but no gps, or another required
+    // stream
+    ret = check_required();
     if(ret)
     {
       std::cout << "Error interpolating sensors. Exiting..." << std::endl;
       return ret;
     }
-    else
-    {
-      std::cout << "Done interpolating sensors." << std::endl << std::endl ;
-    }
-    
-    // create yaml database in the output folder with the metadata for each img
-    std::cout << "Creating metadata yaml dict..." << std::endl;
-    ret = sensorframes_to_yaml(out);
-    if(ret)
-    {
-      std::cout << "Error creating metadata yaml dict. Exiting..." << std::endl;
-      return ret;
-    }
-    else
-    {
-      std::cout << "Done creating metadata yaml dict." << std::endl << std::endl;
-    }
 
+    std::cout << "Done parsing GPMF data, sampling images and creating "
+                 "metadata yaml dict." << std::endl << std::endl;
 
     return ret;
   }
 
-  int32_t converter::get_offset()
+  int32_t converter::get_offset(size_t rate)
+  {
+    return _rates[rate].idx_offset;
+  }
+
+  const std::vector<sensorframe_t>& converter::get_sensorframes(size_t rate)
+  {
+    return _sensor_frames[rate];
+  }
+
+  void converter::set_range(float start, float end)
+  {
+    _start = start;
+    _end = end;
+  }
+
+  void converter::set_fix_gate(uint32_t min_fix, float max_precision)
+  {
+    _min_fix = min_fix;
+    _max_precision = max_precision;
+  }
+
+  int32_t converter::set_backend(img_extr::BACKEND backend)
   {
-    return _idx_offset;
+    return _extractor.set_backend(backend) ? CONV_ERROR : CONV_OK;
+  }
+
+  void converter::add_variant(const img_extr::variant_t& variant)
+  {
+    _extractor.add_variant(variant);
+  }
+
+  void converter::set_timelapse(const std::string& name)
+  {
+    _extractor.set_timelapse(name);
+  }
+
+  int32_t converter::finish()
+  {
+    return _extractor.finish() ? CONV_CANT_CREATE_OUTPUT : CONV_OK;
+  }
+
+  void converter::file_range(size_t rate, float& start, float& end)
+  {
+    // timestamps of the images of this file are offset by the images of the
+    // previous files of the run (see populate_images), so the range is too
+    float file_start = _rates[rate].idx_offset * (1.0 / _rates[rate].fr);
+    start = _start - file_start;
+    end = _end < 0 ? std::numeric_limits<float>::max() : _end - file_start;
+  }
+
+  uint32_t converter::images_in_file(size_t rate)
+  {
+    // same stepping as populate_images, up to the end of the video
+    float ts = 0.0;
+    float step = 1.0 / _rates[rate].fr;
+    float duration = _extractor.get_duration();
+    uint32_t n = 0;
+    while(ts+n*step <= duration)
+      n++;
+    return n;
   }
 
   int32_t converter::cleanup()
   {
     if (_payload) FreeGPMFPayload(_payload);
     _payload = NULL;
-    CloseGPMFSource();
+    _source = NULL;
+    _reader.close();
 
     // empty the maps
-    _gps.clear();
-    _sensor_frames.clear();
+    for(auto& stream:_streams.s)
+    {
+      stream.ts.clear();
+      stream.data.clear();
+    }
+    _utc.clear();
+    _fix.clear();
+    _fix_samples = 0;
+    _gated = false;
+    for(auto& frames:_sensor_frames)
+      frames.clear();
 
     return CONV_OK;
   }
 
   // intermediate functions
-  int32_t converter::gpmf_to_maps()
+  int32_t converter::gpmf_to_maps(chunk_queue_t& chunks)
   {
     int32_t ret = CONV_OK;
 
     if (_metadatalength > 0.0)
     {
-      uint32_t index, payloads = GetNumberGPMFPayloads();
+      uint32_t index, payloads = _reader.payloads();
+
+      // errors go down the queue too, so the images stop
+      auto fail = [&](int32_t err)
+      {
+        payload_chunk_t c;
+        c.ret = err;
+        chunks.push(c);
+        return err;
+      };
+
+      // only parse the payloads that overlap the time range we extract, plus
+      // one on each side so the first and last images can be interpolated.
+      // With several rates, the range of any of them.
+      float range_start = std::numeric_limits<float>::max();
+      float range_end = -std::numeric_limits<float>::max();
+      for (size_t r = 0; r < _rates.size(); r++)
+      {
+        float start, end;
+        file_range(r, start, end);
+        range_start = std::min(range_start, start);
+        range_end = std::max(range_end, end);
+      }
+      uint32_t first = payloads, last = 0;
       for (index = 0; index < payloads; index++)
       {
-        uint32_t payloadsize = GetGPMFPayloadSize(index);
         float in = 0.0, out = 0.0; //times
-        _payload = GetGPMFPayload(_payload, index);
-        if (_payload == NULL)
+        if (!_reader.payload_time(index, in, out))
         {
-          cleanup();
-          return CONV_NO_PAYLOAD;
+          return fail(CONV_NO_PAYLOAD);
         }
-
-        ret = GetGPMFPayloadTime(index, &in, &out);
-        if (ret != GPMF_OK)
+        if (out >= range_start && in <= range_end)
         {
-          cleanup();
-          return CONV_NO_PAYLOAD;
+          first = std::min(first, index);
+          last = index;
         }
-        DEBUG("MP4 Payload time %.3f to %.3f seconds\n", in, out);
-
-        ret = GPMF_Init(_ms, _payload, payloadsize);
-        if (ret != GPMF_OK)
+      }
+      if (first > last)
+      {
+        DEBUG("No payloads in the time range of this file.\n");
+        return ret;
+      }
+      first = first > 0 ? first - 1 : first;
+      last = last + 1 < payloads ? last + 1 : last;
+      DEBUG("Parsing payloads %u to %u of %u\n", first, last, payloads);
+
+      // verbose output is per payload, so keep it in order with one thread
+      uint32_t threads = _verbose ? 1 : std::thread::hardware_concurrency();
+      threads = std::max(1u, threads);
+      DEBUG("Parsing payloads with %u threads\n", threads);
+
+      // a batch of payloads at a time: read them one after the other (the
+      // reader seeks and reads its single file handle), parse them on all
+      // cores, each one into its own chunk, and hand the chunks over in
+      // order. The queue stops us when we are far enough ahead of the images.
+      for (uint32_t batch = first; batch <= last; batch += threads)
+      {
+        uint32_t n = std::min(threads, last - batch + 1);
+        std::vector<payload_t> payload(n);
+        for (index = batch; index < batch + n; index++)
         {
-          cleanup();
-          return CONV_INIT_ERROR;
+          payload_t& p = payload[index - batch];
+          p.index = index;
+          p.data = _source->payload(index, p.size);
+          if (!p.data || !_reader.payload_time(index, p.in, p.out))
+          {
+            return fail(CONV_NO_PAYLOAD);
+          }
         }
-        // Find all the available Streams and the data carrying FourCC
-        while (GPMF_OK == GPMF_FindNext(_ms, GPMF_KEY_STREAM, GPMF_RECURSE_LEVELS))
+
+        std::vector<payload_chunk_t> chunk(n);
+        std::atomic<uint32_t> next(0);
+        auto work = [&]()
         {
-          if (GPMF_OK == GPMF_SeekToSamples(_ms)) //find the last FOURCC within the stream
-          {
-            uint32_t key = GPMF_Key(_ms);
-            GPMF_SampleType type = static_cast<GPMF_SampleType>(GPMF_Type(_ms));
-            uint32_t elements = GPMF_ElementsInStruct(_ms);
-            uint32_t samples = GPMF_Repeat(_ms);
+          GPMF_stream ms;
+          uint32_t i;
+          while ((i = next++) < n)
+            chunk[i].ret = parse_payload(payload[i], &ms, chunk[i]);
+        };
+        std::vector<std::thread> workers;
+        for (uint32_t t = 1; t < n; t++)
+          workers.push_back(std::thread(work));
+        work();
+        for (auto& w:workers)
+          w.join();
+
+        for (auto& c:chunk)
+        {
+          if (!chunks.push(c))
+            return ret; // the images are done, nothing else to parse for
+          if (c.ret != CONV_OK)
+            return c.ret;
+        }
+      }
 
-            if (samples)
-            {
-              float rate = GetGPMFSampleRateAndTimes(_ms, 0.0, index, &in, &out);
+    }
 
-              DEBUG("  STRM of %c%c%c%c %.3f-%.3fs %.3fHz ", PRINTF_4CC(key), in, out, rate);
+    return ret;
+  }
 
-              if (type == GPMF_TYPE_COMPLEX)
-              {
-                GPMF_stream find_stream;
-                GPMF_CopyState(_ms, &find_stream);
-
-                if (GPMF_OK == GPMF_FindPrev(&find_stream, GPMF_KEY_TYPE, GPMF_CURRENT_LEVEL))
-                {
-                  char tmp[64];
-                  char *data = (char *)GPMF_RawData(&find_stream);
-                  int size = GPMF_RawDataSize(&find_stream);
-
-                  if (size < sizeof(tmp))
-                  {
-                    memcpy(tmp, data, size);
-                    tmp[size] = 0;
-                    DEBUG("of type %s ", tmp);
-                  }
-                }
+  int32_t converter::merge_until(chunk_queue_t& chunks, float ts)
+  {
+    // merge in payload order, which gives the same streams as parsing the
+    // payloads one after the other. Once a payload starting after ts is in,
+    // the samples on both sides of ts are.
+    while (!_parsed && _merged_in <= ts)
+    {
+      payload_chunk_t c;
+      if (!chunks.pop(c))
+      {
+        _parsed = true;
+        break;
+      }
+      if (c.ret != CONV_OK)
+        return c.ret;
+
+      append_visitor append = {*this, c.streams, _streams};
+      int32_t ret = sensors_t::for_each(append);
+      if (ret != CONV_OK)
+        return ret;
+      if (c.unknown_axes && !_axes_warned)
+      {
+        std::cerr << "WARNING: unknown camera axes for GYRO/ACCL in " << _input
+                  << " (no ORIN and unknown model), left in the order they "
+                     "were stored" << std::endl;
+        _axes_warned = true;
+      }
+      if (c.utc.utc >= 0)
+        _utc.push_back(c.utc);
+      update_fix();
+      _merged_in = c.in;
+    }
 
-              }
-              else
-              {
-                DEBUG("of type %c ", type);
-              }
+    return CONV_OK;
+  }
+  
+  int32_t converter::parse_payload(const payload_t& p, GPMF_stream *ms,
+                                   payload_chunk_t& chunk)
+  {
+    int32_t ret;
+    DEBUG("MP4 Payload time %.3f to %.3f seconds\n", p.in, p.out);
+    chunk.in = p.in;
+    chunk.out = p.out;
 
-              DEBUG("with %d sample%s ", samples, samples > 1 ? "s" : "");
+    ret = GPMF_Init(ms, p.data.get(), p.size);
+    if (ret != GPMF_OK)
+    {
+      return CONV_INIT_ERROR;
+    }
+    // Find all the available Streams and the data carrying FourCC
+    while (GPMF_OK == GPMF_FindNext(ms, GPMF_KEY_STREAM, GPMF_RECURSE_LEVELS))
+    {
+      if (GPMF_OK == GPMF_SeekToSamples(ms)) //find the last FOURCC within the stream
+      {
+        uint32_t key = GPMF_Key(ms);
+        GPMF_SampleType type = static_cast<GPMF_SampleType>(GPMF_Type(ms));
+        uint32_t elements = GPMF_ElementsInStruct(ms);
+        uint32_t samples = GPMF_Repeat(ms);
 
-              if (elements > 1)
-                DEBUG("-- %d elements per sample", elements);
+        // only a listing, so skip the (serialized) rate query when quiet
+        if (samples && _verbose)
+        {
+          float in, out;
+          float rate = _reader.sample_rate_and_times(ms, p.index, in, out);
 
-              DEBUG("\n");
-            }
-          }
-        }
-        GPMF_ResetState(_ms);
-        DEBUG("\n"); 
+          DEBUG("  STRM of %c%c%c%c %.3f-%.3fs %.3fHz ", PRINTF_4CC(key), in, out, rate);
 
-        // Find GPS values and return scaled floats. 
-        if (GPMF_OK == GPMF_FindNext(_ms, STR2FOURCC("GPS5"), GPMF_RECURSE_LEVELS)) //GoPro Hero5 GPS
-        {
-          uint32_t samples = GPMF_Repeat(_ms);
-          uint32_t elements = GPMF_ElementsInStruct(_ms);
-          uint32_t buffersize = samples * elements * sizeof(float);
-          GPMF_stream find_stream;
-          float *ptr, *tmpbuffer = static_cast<float*>(malloc(buffersize));
-          char units[10][6] = { "" };
-          uint32_t unit_samples = 1;
-
-          if (tmpbuffer && samples)
+          if (type == GPMF_TYPE_COMPLEX)
           {
-            uint32_t i, j;
+            GPMF_stream find_stream;
+            GPMF_CopyState(ms, &find_stream);
 
-            //Search for any units to display
-            GPMF_CopyState(_ms, &find_stream);
-            if (GPMF_OK == GPMF_FindPrev(&find_stream, GPMF_KEY_SI_UNITS, GPMF_CURRENT_LEVEL) ||
-              GPMF_OK == GPMF_FindPrev(&find_stream, GPMF_KEY_UNITS, GPMF_CURRENT_LEVEL))
+            if (GPMF_OK == GPMF_FindPrev(&find_stream, GPMF_KEY_TYPE, GPMF_CURRENT_LEVEL))
             {
+              char tmp[64];
               char *data = (char *)GPMF_RawData(&find_stream);
-              int ssize = GPMF_StructSize(&find_stream);
-              unit_samples = GPMF_Repeat(&find_stream);
-
-              for (i = 0; i < unit_samples; i++)
-              {           
-                memcpy(units[i], data, ssize);
-                units[i][ssize] = 0;
-                data += ssize;
+              int size = GPMF_RawDataSize(&find_stream);
+
+              if (size < sizeof(tmp))
+              {
+                memcpy(tmp, data, size);
+                tmp[size] = 0;
+                DEBUG("of type %s ", tmp);
               }
             }
 
-            //GPMF_FormattedData(_ms, tmpbuffer, buffersize, 0, samples); // Output data in LittleEnd, but no scale
-            GPMF_ScaledData(_ms, tmpbuffer, buffersize, 0, samples, GPMF_TYPE_FLOAT);  //Output scaled data as floats
+          }
+          else
+          {
+            DEBUG("of type %c ", type);
+          }
 
-            ptr = tmpbuffer;
-            for (i = 0; i < samples; i++)
-            {
-              // create gps_sample to store in map
-              std::vector<float> gps_sample;
+          DEBUG("with %d sample%s ", samples, samples > 1 ? "s" : "");
 
-              //get timestamp for that sample
-              float gps_rate,gps_start,gps_end;
-              gps_rate = 1/GetGPMFSampleRateAndTimes(_ms, 0.0, index, &gps_start, &gps_end);
-              _gps[gps_start+gps_rate*i]=gps_sample;
+          if (elements > 1)
+            DEBUG("-- %d elements per sample", elements);
 
-              //get all value for that sample (lat, long, etc)
-              DEBUG("TIME: %.3fs - ",gps_start+gps_rate*i);
-              for (j = 0; j < elements; j++)
-              {
-                _gps[gps_start+gps_rate*i].push_back(*ptr++);
-                DEBUG("%.6f%s, " ,_gps[gps_start+gps_rate*i][j], units[j%unit_samples]);
-              }
-              DEBUG("\n");              
-            }
-            free(tmpbuffer);
+          DEBUG("\n");
+        }
+      }
+    }
+    GPMF_ResetState(ms);
+    DEBUG("\n"); 
+
+    // camera model, for the sensor axes of the ones without ORIN
+    std::string device;
+    if (GPMF_OK == GPMF_FindNext(ms, STR2FOURCC("DVNM"), GPMF_RECURSE_LEVELS) &&
+        GPMF_Type(ms) == GPMF_TYPE_STRING_ASCII)
+    {
+      const char *name = (const char *)GPMF_RawData(ms);
+      device.assign(name, strnlen(name, GPMF_RawDataSize(ms)));
+    }
+    GPMF_ResetState(ms);
+
+    // Find sensor values and scale them straight into their streams.
+    chunk.unknown_axes = false;
+    parse_visitor parse = {*this, ms, p.index, device, chunk};
+    ret = sensors_t::for_each(parse);
+
+    // UTC time of the payload, to date the images
+    chunk.utc.ts = p.in;
+    chunk.utc.utc = -1;
+    if (GPMF_OK == GPMF_FindNext(ms, STR2FOURCC("GPSU"), GPMF_RECURSE_LEVELS) &&
+        GPMF_Type(ms) == GPMF_TYPE_UTC_DATE_TIME &&
+        parse_gpsu((char *)GPMF_RawData(ms), GPMF_RawDataSize(ms), chunk.utc.utc))
+    {
+      DEBUG("GPSU: %.3f at %.3fs\n", chunk.utc.utc, chunk.utc.ts);
+    }
+    GPMF_ResetState(ms);
+
+    return ret;
+  }
+
+  int32_t converter::append_stream(const sensor_stream_t& from, sensor_stream_t& to)
+  {
+    if (from.ts.empty())
+      return CONV_OK;
+
+    // all samples of the stream need the same layout
+    if (!to.ts.empty() && to.elements != from.elements)
+      return CONV_INVALID_STRUCT;
+    to.elements = from.elements;
+    to.ts.insert(to.ts.end(), from.ts.begin(), from.ts.end());
+    to.data.insert(to.data.end(), from.data.begin(), from.data.end());
+
+    return CONV_OK;
+  }
+
+  int32_t converter::payload_to_stream(GPMF_stream *ms, uint32_t fourcc,
+                                       uint32_t index, uint32_t min_elements,
+                                       sensor_stream_t& stream)
+  {
+    if (GPMF_OK == GPMF_FindNext(ms, fourcc, GPMF_RECURSE_LEVELS))
+    {
+      uint32_t samples = GPMF_Repeat(ms);
+      uint32_t elements = GPMF_ElementsInStruct(ms);
+      GPMF_stream find_stream;
+      char units[10][6] = { "" };
+      uint32_t unit_samples = 1;
+
+      if (samples && elements >= min_elements)
+      {
+        uint32_t i, j;
+
+        //Search for any units to display
+        GPMF_CopyState(ms, &find_stream);
+        if (GPMF_OK == GPMF_FindPrev(&find_stream, GPMF_KEY_SI_UNITS, GPMF_CURRENT_LEVEL) ||
+          GPMF_OK == GPMF_FindPrev(&find_stream, GPMF_KEY_UNITS, GPMF_CURRENT_LEVEL))
+        {
+          char *data = (char *)GPMF_RawData(&find_stream);
+          int ssize = GPMF_StructSize(&find_stream);
+          unit_samples = std::min<uint32_t>(GPMF_Repeat(&find_stream), 10);
+
+          for (i = 0; i < unit_samples; i++)
+          {           
+            memcpy(units[i], data, ssize);
+            units[i][ssize] = 0;
+            data += ssize;
+          }
+        }
+
+        // all samples of the stream need the same layout
+        if (!stream.ts.empty() && stream.elements != elements)
+        {
+          GPMF_ResetState(ms);
+          return CONV_INVALID_STRUCT;
+        }
+        stream.elements = elements;
+
+        // output scaled data as floats at the end of the stream
+        size_t first = stream.ts.size();
+        stream.data.resize((first + samples) * elements);
+        float *ptr = &stream.data[first * elements];
+        gpmf_scale::scaled_data(ms, ptr, samples, elements);
+
+        //get timestamp for the samples (same for the whole payload)
+        float start,end;
+        float rate = 1/_reader.sample_rate_and_times(ms, index, start, end);
+
+        for (i = 0; i < samples; i++)
+        {
+          stream.ts.push_back(start+rate*i);
+
+          //get all value for that sample (lat, long, etc for gps)
+          DEBUG("TIME: %.3fs - ",stream.ts.back());
+          for (j = 0; j < elements; j++)
+          {
+            DEBUG("%.6f%s, " ,*ptr++, units[j%unit_samples]);
           }
+          DEBUG("\n");              
         }
-        GPMF_ResetState(_ms);
-        DEBUG("\n"); 
+      }
+    }
+    GPMF_ResetState(ms);
+    DEBUG("\n"); 
+
+    return CONV_OK;
+  }
+
+  bool converter::find_axes(GPMF_stream *ms, uint32_t fourcc,
+                            const std::string& device, sc::axes_t& axes)
+  {
+    // the ORIN of the stream if it has one, the layout of the model if not
+    bool found = false;
+    if (GPMF_OK == GPMF_FindNext(ms, fourcc, GPMF_RECURSE_LEVELS))
+    {
+      GPMF_stream find_stream;
+      GPMF_CopyState(ms, &find_stream);
+      if (GPMF_OK == GPMF_FindPrev(&find_stream, STR2FOURCC("ORIN"), GPMF_CURRENT_LEVEL) &&
+          GPMF_Type(&find_stream) == GPMF_TYPE_STRING_ASCII)
+      {
+        found = sc::parse_orin((const char *)GPMF_RawData(&find_stream),
+                               GPMF_RawDataSize(&find_stream), axes);
+        if (!found)
+          DEBUG("Can't read the ORIN of %c%c%c%c\n", PRINTF_4CC(fourcc));
+      }
+    }
+    GPMF_ResetState(ms);
+
+    return found || model_axes(device, axes);
+  }
 
+  void converter::update_fix()
+  {
+    const sensor_stream_t& fix = _streams.get<sc::gpsf>();
+    const sensor_stream_t& precision = _streams.get<sc::gpsp>();
+
+    // nothing to gate on if not asked to, or without the fix stream
+    _gated = (_min_fix > 0 || _max_precision > 0) && !fix.ts.empty();
+    if(!_gated)
+      return;
+
+    // every fix sample holds until the next one, so consecutive good samples
+    // make one interval, which the first bad one closes
+    const float open_end = std::numeric_limits<float>::max();
+    for(; _fix_samples < fix.ts.size(); _fix_samples++)
+    {
+      size_t i = _fix_samples;
+      bool good = fix.data[i * fix.elements] >= _min_fix;
+      if(good && _max_precision > 0)
+      {
+        sc::record<sc::gpsp> p;
+        sc::interpolate(precision, fix.ts[i], p);
+        good = p.valid && p.v[0] <= _max_precision;
       }
 
+      bool open = !_fix.empty() && _fix.back().end == open_end;
+      if(good && !open)
+      {
+        interval_t interval = {fix.ts[i], open_end};
+        _fix.push_back(interval);
+      }
+      else if(!good && open)
+      {
+        _fix.back().end = fix.ts[i];
+        DEBUG("GPS fix from %.3fs to %.3fs\n",_fix.back().start,_fix.back().end);
+      }
     }
+  }
 
-    return ret;
+  bool converter::in_fix(float ts)
+  {
+    if(!_gated)
+      return true;
+
+    // last interval starting before ts
+    auto it = std::upper_bound(_fix.begin(), _fix.end(), ts,
+                               [](float t, const interval_t& f){ return t < f.start; });
+    return it != _fix.begin() && ts < (it - 1)->end;
   }
-  
-  int32_t converter::populate_images()
+
+  int32_t converter::populate_images(chunk_queue_t& chunks, entry_queue_t& entries)
   {
     int32_t ret = CONV_OK;
 
-    float ts = 0.0;
-    float step = 1.0 / _fr; // timestep
     float real_ts; // real timestamp from image capture
-    std::string name;  // name of exported image
-    sensorframe_t sf; // sensor frame for each image
+    uint32_t number;  // number of exported image (its name)
+
+    // every rate steps through its own image indexes, kept as if the whole
+    // file was extracted, so that names and timestamps depend neither on the
+    // time range nor on the other rates
+    typedef struct
+    {
+      float step; // timestep
+      uint32_t idx; // next image index
+      uint32_t n_idx; // image indexes this file spans
+      float range_end; // last timestamp to extract
+      bool done; // out of the time range or off bounds
+      bool first; // no image yet to integrate the imu from
+      float prev_img_ts;
+    }cursor_t;
+    std::vector<cursor_t> cursors(_rates.size());
+    for(size_t r = 0; r < _rates.size(); r++)
+    {
+      cursor_t& c = cursors[r];
+      float range_start;
+      c.step = 1.0 / _rates[r].fr;
+      file_range(r, range_start, c.range_end);
+      c.n_idx = images_in_file(r);
+      c.done = false;
+      c.first = true;
+      c.prev_img_ts = 0.0;
+
+      // start at the first image inside the range
+      c.idx = 0;
+      while(c.idx < c.n_idx && c.idx*c.step < range_start)
+        c.idx++;
+      DEBUG("Extracting images %u to %u of this file at %.3f fps.\n",c.idx,c.n_idx,_rates[r].fr);
+    }
+
+    // imu deltas from one image to the next of the same rate, in a single
+    // pass over the samples, which keep coming in as the images go
+    const sensor_stream_t& gyro = _streams.get<sc::gyro>();
+    const sensor_stream_t& accl = _streams.get<sc::accl>();
+    std::vector<imu_pre::preintegrator> imu;
+    for(size_t r = 0; r < _rates.size(); r++)
+      imu.push_back(imu_pre::preintegrator(gyro.ts, gyro.data, gyro.elements,
+                                           accl.ts, accl.data, accl.elements));
+
+    // streams at the last decoded image, for the rates landing on it too
+    sensorframe_t frame;
+    float frame_ts = -1;
 
-    uint32_t idx = 0;
-    uint32_t skipped = 0;
     while(true)
     {
-      float timestep = ts+idx*step;
-      ret = _extractor.get_frame(timestep,real_ts,_idx_offset+idx,name);
+      // next image of any rate, so the video is decoded once, in time order,
+      // for the union of their timestamps
+      size_t r = _rates.size();
+      float timestep = 0;
+      for(size_t i = 0; i < _rates.size(); i++)
+      {
+        cursor_t& c = cursors[i];
+        float t = c.idx*c.step;
+        if(c.done || c.idx >= c.n_idx || t > c.range_end)
+        {
+          c.done = true;
+          continue;
+        }
+        if(r == _rates.size() || t < timestep)
+        {
+          r = i;
+          timestep = t;
+        }
+      }
+      if(r == _rates.size())
+      {
+        DEBUG("Done populating, we are out of the time range.\n");
+        break;
+      }
+      cursor_t& c = cursors[r];
+      const rate_t& rate = _rates[r];
+
+      // the gps fix around the image decides if it is decoded at all
+      ret = merge_until(chunks, timestep);
+      if(ret)
+        return ret;
+      if(!in_fix(timestep))
+      {
+        DEBUG("No GPS fix at %.5f, skipping frame.\n",timestep);
+        c.idx++;
+        continue;
+      }
+
+      // rates landing on the frame that was just decoded reuse it
+      ret = _extractor.get_frame(timestep,real_ts);
       if(ret == img_extr::EXTR_CANT_FRAME_OUT_OF_BOUNDS)
       {
-        DEBUG("Done populating, we are off bounds.\n");
-        _n_images = idx - skipped;
-        DEBUG("Number of images extracted for database is %u.\n",_n_images);
-        //final offset for next batch of files
-        _idx_offset+=idx;
-        return CONV_OK;
+        DEBUG("Done populating at %.3f fps, we are off bounds.\n",rate.fr);
+        c.done = true;
+        continue;
       }
       else if(ret == img_extr::EXTR_SKIPPING_FRAME)
       {
         DEBUG("Skipping frame. Don't save to list\n");
-        idx++;
-        skipped++;
+        c.idx++;
         continue;
       }
-
       else if(ret)
       {
         DEBUG("ERROR GETTING FRAME\n");
         return CONV_ERROR;
       }
-      // populate a sensor frame for each image and put only timestamp for now
-      // (interpolated gps, and other sensors will be populated later)
-      sf.ts = real_ts+_idx_offset*step;
-      _sensor_frames[name] = sf;
-      DEBUG("ts: %.5f, real ts: %.5f, name: %s\n\n",timestep+_idx_offset*step,_sensor_frames[name].ts,name.c_str());
-      idx++;
-    }
-    //final offset for next batch of files
-    _idx_offset+=idx;
-    return ret;
+
+      // populate a sensor frame for each image, with every stream at its
+      // timestamp in the file, before saving it so the position and time go
+      // in the exif of the image. Its timestamp in the run comes after the
+      // images of the previous files.
+      if(real_ts != frame_ts)
+      {
+        ret = merge_until(chunks, real_ts);
+        if(ret)
+          return ret;
+        sensors_to_sensorframe(real_ts, frame);
+        frame_ts = real_ts;
+      }
+      sensorframe_t sf = frame;
+      sf.ts = real_ts+rate.idx_offset*c.step;
+      DEBUG("           img ts: %.10f.\n",sf.ts);
+
+      // first image of the file has nothing to integrate from
+      if(c.first)
+      {
+        imu_pre::reset(sf.imu);
+        c.first = false;
+      }
+      else
+      {
+        imu[r].integrate(c.prev_img_ts, real_ts, sf.imu);
+      }
+      c.prev_img_ts = real_ts;
+      DEBUG("      imu dt: %.5f, gyro samples: %u, accl samples: %u.\n",
+            sf.imu.dt,sf.imu.n_gyro,sf.imu.n_accl);
+
+      const sc::record<sc::gps5>& gps = sf.sensors.get<sc::gps5>();
+      exif_writer::gps_tags_t tags = {gps.valid, 0, 0, 0, 0, sf.utc};
+      if(gps.valid)
+      {
+        tags.lat = gps.v[0];
+        tags.lon = gps.v[1];
+        tags.alt = gps.v[2];
+        tags.speed = gps.v[3]; // 2D ground speed
+      }
+
+      if(_extractor.save_frame(rate.idx_offset+c.idx,&tags,number,r))
+      {
+        DEBUG("ERROR SAVING FRAME\n");
+        return CONV_ERROR;
+      }
+      sf.idx = number;
+      _sensor_frames[r].push_back(sf);
+      DEBUG("ts: %.5f, real ts: %.5f, name: %s\n\n",timestep+rate.idx_offset*c.step,sf.ts,
+            _extractor.frame_name(number).c_str());
+
+      // and out to the yaml right away
+      entry_t entry = {r, sf, false};
+      if(!entries.push(entry))
+      {
+        DEBUG("ERROR WRITING METADATA\n");
+        return CONV_CANT_CREATE_OUTPUT;
+      }
+      c.idx++;
+    }
+
+    if(_gated)
+    {
+      float total = 0;
+      for(auto& f:_fix)
+        total += std::min(f.end, _extractor.get_duration()) - f.start;
+      std::cout << "Good GPS fix for " << total << "s of " << _extractor.get_duration()
+                << "s, in " << _fix.size() << " intervals" << std::endl;
+    }
+
+    for(size_t r = 0; r < _rates.size(); r++)
+    {
+      DEBUG("Number of images extracted for database at %.3f fps is %lu.\n",
+            _rates[r].fr,_sensor_frames[r].size());
+      //final offset for next batch of files
+      _rates[r].idx_offset += cursors[r].n_idx;
+    }
+    return CONV_OK;
   }
   
-  int32_t converter::sensors_to_sensorframes()
+  void converter::sensors_to_sensorframe(float ts, sensorframe_t& sf)
   {
+    /* 
+      Get every stream right before and right after that timestamp, and
+      interpolate following its schema. Special cases are first image and
+      last image, that may not have 2 data points, so we get the closest
+      one. First case never happens to us because first frame of opencv
+      video is always 0.0 and same for gopro sensor data. Also the
+      astronomical chance that a sensor ts coincides with sample time of
+      image.
+    */
+    interp_visitor interp = {_streams, ts, sf.sensors, _verbose};
+    sensors_t::for_each(interp);
+    sf.utc = utc_at(ts);
+  }
+
+  int32_t converter::check_required()
+  {
+    // nothing to interpolate from (only happens if there are images but no
+    // gps, or another required stream)
+    bool images = false;
+    for(auto& frames:_sensor_frames)
+      images |= !frames.empty();
+    if(!images)
+      return CONV_OK;
+
+    required_visitor required = {_streams};
+    return sensors_t::for_each(required);
+  }
+  
+  double converter::utc_at(float ts)
+  {
+    if(_utc.empty())
+      return -1;
+
+    // GPS time of the last payload starting before ts, plus the time since
+    // (the first payload for images before it)
+    auto it = std::upper_bound(_utc.begin(), _utc.end(), ts,
+                               [](float t, const utc_t& u){ return t < u.ts; });
+    const utc_t& u = it == _utc.begin() ? *it : *(it - 1);
+    return u.utc + (ts - u.ts);
+  }
+
+  int32_t converter::sensorframes_to_yaml(entry_queue_t& entries,
+                                          const std::vector<md_wr::writer*>& writer)
+  {
+
     int32_t ret = CONV_OK;
 
-    // for each image and sensor frame in the map, get the closest 2 timestamps
-    // for each sensor map and interpolate its info.
-    for (auto& sf:_sensor_frames)
-    { 
-      DEBUG("\n\n");
-      DEBUG("Image sample name: %s.\n",sf.first.c_str());
-
-      // get the timestamp for image
-      float ts = sf.second.ts;
-      
-      /* 
-        Get gps info right before and right after that timestamp.
-        Special cases are first image and last image, that may not 
-        have 2 data points, so we get the closest one. First case never
-        happens to us because first frame of opencv video is always 0.0 and 
-        same for gopro sensor data. Also the astronomical chance that a sensor
-        ts coincides with sample time of image.
-      */
-      float prev_ts=_gps.begin()->first, next_ts=_gps.rbegin()->first, delta_ts;
-      float interp_gps[5];
-      
-      // this covers the general case (middle of file) and the coincidence
-      for(auto const& sample: _gps)
+    //comments with some info about the program run
+    //put every sensor frame in yaml file. Each entry is formatted on its
+    //own, as a one key map, and streamed out as soon as it can, so the
+    //document is never held in memory as a whole. Entries come from the
+    //images as they are saved, in order, and each one goes to the file of
+    //its rate. They are grouped in blocks of up to METADATA_BLOCK, formatted
+    //on all cores while the next ones come in, and written in order. A
+    //block is handed over when it is full, or as soon as no entry is
+    //waiting, and then everything formatted is written: when the images are
+    //the slow stage every entry goes out while the next image is decoded.
+    uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+    block_queue_t todo(threads);
+    std::deque<std::shared_ptr<block_t>> inflight; // handed over, in order
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < threads; t++)
+    {
+      workers.push_back(std::thread([&]()
       {
-        if(sample.first < ts)
+        std::shared_ptr<block_t> block;
+        while (todo.pop(block))
         {
-          prev_ts = sample.first;
+          for (auto& e:block->entries)
+            format_entry(e, block->text);
+          std::lock_guard<std::mutex> lock(done_mutex);
+          block->done = true;
+          done_cv.notify_all();
         }
-        else if(sample.first > ts)
+      }));
+    }
+
+    // writes the blocks at the front that are done, waiting for them while
+    // more than keep are in flight
+    auto write_done = [&](size_t keep) -> int32_t
+    {
+      while (!inflight.empty())
+      {
+        std::shared_ptr<block_t> block = inflight.front();
         {
-          next_ts = sample.first;
-          break;
+          std::unique_lock<std::mutex> lock(done_mutex);
+          while (!block->done && inflight.size() > keep)
+            done_cv.wait(lock);
+          if (!block->done)
+            break;
         }
-        else //same
+        inflight.pop_front();
+        int32_t r = write_block(*block, *writer[block->rate]);
+        if (r)
+          return r;
+      }
+      return CONV_OK;
+    };
+
+    // block being filled for every rate
+    std::vector<std::shared_ptr<block_t>> filling(writer.size());
+    auto hand_over = [&](size_t rate)
+    {
+      inflight.push_back(filling[rate]);
+      todo.push(filling[rate]);
+      filling[rate].reset();
+    };
+
+    std::vector<char> first(writer.size(), true);
+    entry_t entry;
+    while (ret == CONV_OK)
+    {
+      if (!entries.try_pop(entry))
+      {
+        // nothing waiting: out with what we have before waiting for more
+        for (size_t r = 0; r < filling.size(); r++)
         {
-          prev_ts = sample.first;
-          next_ts = sample.first;
-          break;
+          if (filling[r])
+            hand_over(r);
         }
+        ret = write_done(0);
+        if (ret || !entries.pop(entry))
+          break;
       }
 
-      DEBUG("      prev gps ts: %.10f.\n",prev_ts);
-      DEBUG("           img ts: %.10f.\n",sf.second.ts);
-      DEBUG("      next gps ts: %.10f.\n",next_ts);
+      // if it is the first image of this file, comment where it was taken
+      entry.first = first[entry.rate];
+      first[entry.rate] = false;
 
-      // interpolate for each one, taking into consideration the 0 delta case,
-      // which happens when gps frame coincides with image sample, and in the 
-      // last image, which may not have gps data after it.
-      for(int i=0; i<5; i++)
+      std::shared_ptr<block_t>& block = filling[entry.rate];
+      if (!block)
       {
-        if(next_ts>prev_ts)
-        {
-          delta_ts = next_ts - prev_ts; // delta ts
-          float m = (_gps[next_ts][i] - _gps[prev_ts][i]) / delta_ts;
-          sf.second.gps[i] = _gps[prev_ts][i] + m * (ts - prev_ts);
-        }
-        else
-        {
-          // DEBUG("-------------------Same ts!\n");
-          sf.second.gps[i] = _gps[prev_ts][i];
-        }
-        DEBUG("      prev gps[%d]: %.10f.\n",i,_gps[prev_ts][i]);
-        DEBUG("  Interpolated[%d]: %.10f.\n",i,sf.second.gps[i]);
-        DEBUG("      next gps[%d]: %.10f.\n",i,_gps[next_ts][i]);
+        block = std::make_shared<block_t>();
+        block->rate = entry.rate;
+        block->done = false;
+        block->entries.reserve(METADATA_BLOCK);
       }
+      block->entries.push_back(entry);
+      if (block->entries.size() >= METADATA_BLOCK)
+        hand_over(entry.rate);
+
+      // a couple of blocks per worker at most
+      ret = write_done(2 * threads);
     }
 
+    todo.close();
+    for (auto& w:workers)
+      w.join();
 
     return ret;
-  }
-  
-  int32_t converter::sensorframes_to_yaml(YAML::Emitter & out)
-  {
 
-    int32_t ret = CONV_OK;
+  }
 
-    //comments with some info about the program run
-    //put every sensor frame in yaml file
-    bool first = true;
-    for (auto& sf:_sensor_frames)
+  int32_t converter::write_block(const block_t& block, md_wr::writer& writer)
+  {
+    // debug() impl makes no sense here because the text is already there
+    if(_verbose)
     {
-      // create entry for the file name
-      out << YAML::Key << sf.first;
-      out << YAML::Value;
-
-      // if it is the first video of this file, comment where it was taken
-      if(first)
-      {
-        out << YAML::Comment("Original File: "+_input+", Frame rate: "+std::to_string(_fr));
-        first=false;
-      }
+      std::cout << block.text;
+    }
 
-      // create timestamp
-      out << YAML::BeginMap;
-      out << YAML::Key << "ts";
-      out << YAML::Value << sf.second.ts;
-      
-      // output gps data
-      out << YAML::Key << "gps";
-      out << YAML::Value;
-
-      out << YAML::BeginMap;
-      out << YAML::Key << "lat" << YAML::Value << sf.second.gps[0];
-      out << YAML::Key << "long" << YAML::Value<< sf.second.gps[1];
-      out << YAML::Key << "alt" << YAML::Value << sf.second.gps[2];
-      out << YAML::Key << "2dv" << YAML::Value << sf.second.gps[3];
-      out << YAML::Key << "3dv" << YAML::Value << sf.second.gps[4]; 
-      out << YAML::EndMap;
-      
-      out << YAML::EndMap;
-    }
-
-    // debug() impl makes no sense here because there is already a << 
-    // impl for the whole file
-    if(_verbose)
+    if(writer.write(block.text))
     {
-      std::cout << out.c_str() << std::endl << std::endl;
+      std::cerr << "Error writing metadata of "
+                << _extractor.frame_name(block.entries.front().sf.idx) << std::endl;
+      return CONV_CANT_CREATE_OUTPUT;
     }
 
-    return ret;
+    return CONV_OK;
+  }
 
+  void converter::format_entry(const entry_t& entry, std::string& text)
+  {
+    // the same text the yaml emitter writes for the entry as a one key map
+    // (block maps indented by 2, floats at its precision), without going
+    // through it
+    const sensorframe_t& sf = entry.sf;
+    text += _extractor.frame_name(sf.idx);
+    text += ":";
+    if(entry.first)
+    {
+      text += "  # Original File: " + _input + ", Frame rate: " +
+              std::to_string(_rates[entry.rate].fr);
+    }
+    text += "\n  ts: ";
+    yaml_format::append_float(text, sf.ts);
+    text += "\n";
+
+    // every stream (gps, gyro, ...)
+    format_visitor format = {text, sf.sensors};
+    sensors_t::for_each(format);
+
+    // imu deltas from the previous image
+    const imu_pre::imu_interval_t& imu = sf.imu;
+    static const char *const xyz[] = {"x", "y", "z"};
+    static const char *const wxyz[] = {"w", "x", "y", "z"};
+    text += "  imu:\n    dt: ";
+    yaml_format::append_float(text, imu.dt);
+    text += "\n    n_gyro: ";
+    yaml_format::append_uint(text, imu.n_gyro);
+    text += "\n    n_accl: ";
+    yaml_format::append_uint(text, imu.n_accl);
+    text += "\n    dq:\n";
+    for (int i = 0; i < 4; i++)
+    {
+      text += "      ";
+      text += wxyz[i];
+      text += ": ";
+      yaml_format::append_float(text, imu.dq[i]);
+      text += "\n";
+    }
+    text += "    dv:\n";
+    for (int i = 0; i < 3; i++)
+    {
+      text += "      ";
+      text += xyz[i];
+      text += ": ";
+      yaml_format::append_float(text, imu.dv[i]);
+      text += "\n";
+    }
+    text += "    dp:\n";
+    for (int i = 0; i < 3; i++)
+    {
+      text += "      ";
+      text += xyz[i];
+      text += ": ";
+      yaml_format::append_float(text, imu.dp[i]);
+      text += "\n";
+    }
   }
 
   // destructor
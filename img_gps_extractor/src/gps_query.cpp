@@ -0,0 +1,157 @@
+/*
+ * GPS query tool
+ *
+ * Answers radius, bounding box and nearest neighbour queries against the
+ * spatial index written by img_gps_extractor next to metadata.yaml.
+ *
+ */
+
+// basic stuff
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <chrono>
+
+// boost program options to parse args
+#include "boost/program_options.hpp"
+namespace po = boost::program_options;
+
+// index
+#include "spatial_index.hpp"
+namespace sp_idx = spatial_index;
+
+//config file
+#include "config.h"
+
+// parses a comma separated list of n numbers
+static bool parse_list(const std::string& arg, size_t n, std::vector<double>& values)
+{
+  std::stringstream ss(arg);
+  std::string item;
+  values.clear();
+  while(std::getline(ss, item, ','))
+  {
+    char *end;
+    double v = strtod(item.c_str(), &end);
+    if(end == item.c_str() || *end != 0)
+      return false;
+    values.push_back(v);
+  }
+  return values.size() == n;
+}
+
+int main(int argc, char *argv[])
+{
+  bool verbose=false;
+  std::string index_file;
+
+  // parser for command line options
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help", "Print help messages")
+    ("verbose,v", "Verbose")
+    ("index,x",po::value<std::string>(), "Spatial index (spatial_index.bin in the output directory)")
+    ("radius,r",po::value<std::string>(), "Images within a radius: lat,long,meters")
+    ("bbox,b",po::value<std::string>(), "Images inside a bounding box: min_lat,min_long,max_lat,max_long")
+    ("nearest,n",po::value<std::string>(), "Nearest k images: lat,long,k");
+
+  // parse args
+  po::variables_map vm;
+  try
+  {
+    po::store(po::parse_command_line(argc, argv, desc),vm); // can throw
+
+    // help!
+    if(vm.count("help"))
+    {
+      std::cout << "Queries the images extracted by img_gps_extractor by"
+                   " position." << std::endl << desc << std::endl;
+      return sp_idx::INDEX_OK;
+    }
+
+    if(vm.count("index")==0)
+    {
+      std::cerr << "ERROR: Index file is necessary. Exiting..." << std::endl;
+      return sp_idx::INDEX_CANT_OPEN;
+    }
+    index_file.assign(vm["index"].as<std::string>());
+
+    if(vm.count("radius") + vm.count("bbox") + vm.count("nearest") != 1)
+    {
+      std::cerr << "ERROR: Exactly one of radius/bbox/nearest is necessary. Exiting..." << std::endl;
+      return sp_idx::INDEX_ERROR;
+    }
+
+    verbose = vm.count("verbose");
+    if(verbose)
+    {
+      std::cout << "BUILD_GIT_HASH: " << BUILD_GIT_HASH << std::endl;
+    }
+
+    po::notify(vm);
+  }
+  catch(po::error& e)
+  {
+    std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+    std::cerr << desc << std::endl;
+    return sp_idx::INDEX_ERROR;
+  }
+
+  sp_idx::index idx(verbose);
+  if(idx.load(index_file))
+  {
+    std::cerr << "ERROR loading index " << index_file << ". Exiting" << std::endl;
+    return sp_idx::INDEX_CANT_OPEN;
+  }
+
+  std::vector<double> args;
+  std::vector<sp_idx::result_t> results;
+  auto begin_time = std::chrono::steady_clock::now();
+  if(vm.count("radius"))
+  {
+    if(!parse_list(vm["radius"].as<std::string>(), 3, args))
+    {
+      std::cerr << "ERROR: radius is lat,long,meters. Exiting..." << std::endl;
+      return sp_idx::INDEX_ERROR;
+    }
+    idx.radius(args[0], args[1], args[2], results);
+  }
+  else if(vm.count("bbox"))
+  {
+    if(!parse_list(vm["bbox"].as<std::string>(), 4, args))
+    {
+      std::cerr << "ERROR: bbox is min_lat,min_long,max_lat,max_long. Exiting..." << std::endl;
+      return sp_idx::INDEX_ERROR;
+    }
+    idx.bbox(args[0], args[1], args[2], args[3], results);
+  }
+  else
+  {
+    if(!parse_list(vm["nearest"].as<std::string>(), 3, args) || args[2] < 1)
+    {
+      std::cerr << "ERROR: nearest is lat,long,k. Exiting..." << std::endl;
+      return sp_idx::INDEX_ERROR;
+    }
+    idx.nearest(args[0], args[1], static_cast<uint32_t>(args[2]), results);
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin_time).count();
+
+  // one image per line: name lat long distance
+  for(auto& r:results)
+  {
+    printf("%s %.7f %.7f %.2f\n", sp_idx::image_name(r.entry.idx).c_str(),
+           r.entry.lat, r.entry.lon, r.dist);
+  }
+
+  if(verbose)
+  {
+    std::cerr << results.size() << " of " << idx.size() << " images in "
+              << elapsed * 1000 << "ms" << std::endl;
+  }
+
+  return sp_idx::INDEX_OK;
+}
@@ -0,0 +1,171 @@
+/*
+ * IMU preintegration
+ *
+ * Integrates gyroscope and accelerometer samples between consecutive
+ * extracted images into relative rotation, velocity and position deltas
+ * (expressed in the IMU frame at the first image of the interval), in one
+ * forward pass over the samples.
+ *
+ */
+
+// class definitions
+#include "imu_preintegration.hpp"
+
+// basic stuff
+#include <math.h>
+#include <algorithm>
+
+namespace imu_preintegration
+{
+
+  // q = q * r (w, x, y, z)
+  static void quat_mult(double q[4], const double r[4])
+  {
+    double w = q[0]*r[0] - q[1]*r[1] - q[2]*r[2] - q[3]*r[3];
+    double x = q[0]*r[1] + q[1]*r[0] + q[2]*r[3] - q[3]*r[2];
+    double y = q[0]*r[2] - q[1]*r[3] + q[2]*r[0] + q[3]*r[1];
+    double z = q[0]*r[3] + q[1]*r[2] - q[2]*r[1] + q[3]*r[0];
+    q[0] = w; q[1] = x; q[2] = y; q[3] = z;
+  }
+
+  // out = q * v * q^-1
+  static void quat_rotate(const double q[4], const double v[3], double out[3])
+  {
+    // t = 2 * cross(q.xyz, v), out = v + w * t + cross(q.xyz, t)
+    double t[3] = { 2 * (q[2]*v[2] - q[3]*v[1]),
+                    2 * (q[3]*v[0] - q[1]*v[2]),
+                    2 * (q[1]*v[1] - q[2]*v[0]) };
+    out[0] = v[0] + q[0]*t[0] + (q[2]*t[2] - q[3]*t[1]);
+    out[1] = v[1] + q[0]*t[1] + (q[3]*t[0] - q[1]*t[2]);
+    out[2] = v[2] + q[0]*t[2] + (q[1]*t[1] - q[2]*t[0]);
+  }
+
+  // quaternion of the rotation vector theta (exponential map)
+  static void quat_exp(const double theta[3], double q[4])
+  {
+    double angle = sqrt(theta[0]*theta[0] + theta[1]*theta[1] + theta[2]*theta[2]);
+    double s = angle > 1e-9 ? sin(angle / 2) / angle : 0.5; // sin(x/2)/x -> 1/2
+    q[0] = cos(angle / 2);
+    q[1] = theta[0] * s;
+    q[2] = theta[1] * s;
+    q[3] = theta[2] * s;
+  }
+
+  void reset(imu_interval_t& interval)
+  {
+    interval.dt = 0;
+    interval.dq[0] = 1;
+    interval.dq[1] = interval.dq[2] = interval.dq[3] = 0;
+    interval.dv[0] = interval.dv[1] = interval.dv[2] = 0;
+    interval.dp[0] = interval.dp[1] = interval.dp[2] = 0;
+    interval.n_gyro = 0;
+    interval.n_accl = 0;
+  }
+
+  preintegrator::preintegrator(const std::vector<float>& gyro_ts, const std::vector<float>& gyro,
+                               const uint32_t& gyro_stride,
+                               const std::vector<float>& accl_ts, const std::vector<float>& accl,
+                               const uint32_t& accl_stride):
+                               _gyro{gyro_ts, gyro, gyro_stride, 0},
+                               _accl{accl_ts, accl, accl_stride, 0}
+  {
+  }
+
+  void preintegrator::sample(stream_t& s, double t, double v[3])
+  {
+    size_t n = s.ts.size();
+    if(n == 0)
+    {
+      v[0] = v[1] = v[2] = 0;
+      return;
+    }
+
+    // times only go forward, so the cursor does too
+    while(s.cursor + 1 < n && s.ts[s.cursor + 1] <= t)
+      s.cursor++;
+
+    const float *a = &s.data[s.cursor * s.stride];
+    if(t <= s.ts[s.cursor] || s.cursor + 1 == n)
+    {
+      // before the first sample or after the last one
+      v[0] = a[0]; v[1] = a[1]; v[2] = a[2];
+      return;
+    }
+
+    const float *b = &s.data[(s.cursor + 1) * s.stride];
+    double w = (t - s.ts[s.cursor]) / (s.ts[s.cursor + 1] - s.ts[s.cursor]);
+    for(int i = 0; i < 3; i++)
+      v[i] = a[i] + w * (b[i] - a[i]);
+  }
+
+  uint32_t preintegrator::count(stream_t& s, double t0, double t1)
+  {
+    auto first = std::upper_bound(s.ts.begin(), s.ts.end(), t0);
+    auto last = std::upper_bound(s.ts.begin(), s.ts.end(), t1);
+    return last - first;
+  }
+
+  void preintegrator::integrate(float t0, float t1, imu_interval_t& interval)
+  {
+    reset(interval);
+    if(!(t1 > t0))
+      return;
+
+    interval.dt = t1 - t0;
+    interval.n_gyro = count(_gyro, t0, t1);
+    interval.n_accl = count(_accl, t0, t1);
+
+    double q[4] = {1, 0, 0, 0}; // rotation from the frame at t0
+    double v[3] = {0, 0, 0};
+    double p[3] = {0, 0, 0};
+
+    // step from sample to sample of either sensor, using the interpolated
+    // rates in the middle of each step
+    size_t gi = std::upper_bound(_gyro.ts.begin(), _gyro.ts.end(), t0) - _gyro.ts.begin();
+    size_t ai = std::upper_bound(_accl.ts.begin(), _accl.ts.end(), t0) - _accl.ts.begin();
+    double t = t0;
+    while(t < t1)
+    {
+      double tg = gi < _gyro.ts.size() ? _gyro.ts[gi] : t1;
+      double ta = ai < _accl.ts.size() ? _accl.ts[ai] : t1;
+      double tn = std::min(std::min(tg, ta), static_cast<double>(t1));
+      if(tg <= tn && gi < _gyro.ts.size())
+        gi++;
+      if(ta <= tn && ai < _accl.ts.size())
+        ai++;
+
+      double dt = tn - t;
+      if(dt <= 0)
+        continue;
+
+      double mid = t + dt / 2;
+      double w[3], a[3], ra[3], theta[3], dq[4];
+      sample(_gyro, mid, w);
+      sample(_accl, mid, a);
+
+      // acceleration in the frame at t0, with the rotation at the step start
+      quat_rotate(q, a, ra);
+      for(int i = 0; i < 3; i++)
+      {
+        p[i] += v[i] * dt + 0.5 * ra[i] * dt * dt;
+        v[i] += ra[i] * dt;
+        theta[i] = w[i] * dt;
+      }
+
+      quat_exp(theta, dq);
+      quat_mult(q, dq);
+      t = tn;
+    }
+
+    // keep it a unit quaternion
+    double norm = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    for(int i = 0; i < 4; i++)
+      interval.dq[i] = q[i] / norm;
+    for(int i = 0; i < 3; i++)
+    {
+      interval.dv[i] = v[i];
+      interval.dp[i] = p[i];
+    }
+  }
+
+}
@@ -0,0 +1,238 @@
+/*
+ * Multi-session ingest
+ *
+ * Recursively discovers GoPro recordings in a directory tree (eg. a whole
+ * SD card dump), groups the chapters of each recording together and runs
+ * every recording (session) through a pool of workers.
+ *
+ */
+
+// class definitions
+#include "ingest.hpp"
+
+// basic stuff
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <iostream>
+#include <map>
+#include <tuple>
+#include <algorithm>
+
+// worker processes
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// boost filesystem to walk the tree
+#include "boost/filesystem.hpp"
+namespace fs = boost::filesystem;
+
+namespace ingest
+{
+
+  // true if the n chars of s starting at pos are digits
+  static bool all_digits(const std::string& s, size_t pos, size_t n)
+  {
+    if(s.length() < pos + n)
+      return false;
+    for(size_t i = pos; i < pos + n; i++)
+    {
+      if(!isdigit(static_cast<unsigned char>(s[i])))
+        return false;
+    }
+    return true;
+  }
+
+  bool parse_name(const std::string& filename, std::string& family,
+                  uint32_t& number, uint32_t& chapter)
+  {
+    fs::path p(filename);
+    std::string ext = p.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::toupper);
+    if(ext != ".MP4")
+      return false;
+
+    // all gopro names are 8 chars long (GOPRxxxx, GPccxxxx, GHccxxxx, GXccxxxx)
+    std::string stem = p.stem().string();
+    std::transform(stem.begin(), stem.end(), stem.begin(), ::toupper);
+    if(stem.length() != 8 || !all_digits(stem, 4, 4))
+      return false;
+
+    number = atoi(stem.substr(4).c_str());
+    if(stem.compare(0, 4, "GOPR") == 0)
+    {
+      family = "GP";
+      chapter = 0;
+    }
+    else if(all_digits(stem, 2, 2) &&
+            (stem.compare(0, 2, "GP") == 0 ||
+             stem.compare(0, 2, "GH") == 0 ||
+             stem.compare(0, 2, "GX") == 0))
+    {
+      family = stem.substr(0, 2);
+      chapter = atoi(stem.substr(2, 2).c_str());
+    }
+    else
+    {
+      return false;
+    }
+
+    return true;
+  }
+
+  int32_t discover_sessions(const std::string& root,
+                            std::vector<session_t>& sessions,
+                            bool verbose)
+  {
+    bool _verbose = verbose;
+    fs::path root_path(root);
+    if(!fs::is_directory(root_path))
+    {
+      std::cerr << "Input dir " << root << " doesn't exist." << std::endl;
+      return INGEST_INPUT_NON_EXISTENT;
+    }
+
+    // group chapters by (directory, family, number). Chapters of a recording
+    // always live in the same directory, but the same recording number can
+    // appear in different directories of a dump (different cards)
+    typedef std::tuple<std::string, std::string, uint32_t> session_key;
+    std::map<session_key, std::map<uint32_t, std::string> > groups;
+
+    fs::recursive_directory_iterator it(root_path), end;
+    for(; it != end; ++it)
+    {
+      if(!fs::is_regular_file(it->status()))
+        continue;
+
+      std::string family;
+      uint32_t number, chapter;
+      if(!parse_name(it->path().filename().string(), family, number, chapter))
+        continue;
+
+      // relative directory of the recording with respect to the root
+      std::string rel_dir;
+      fs::path parent = it->path().parent_path();
+      while(!parent.empty() && !fs::equivalent(parent, root_path))
+      {
+        rel_dir = rel_dir.empty() ? parent.filename().string() :
+                  parent.filename().string() + "/" + rel_dir;
+        parent = parent.parent_path();
+      }
+
+      DEBUG("Found chapter %u of %s%04u in '%s': %s\n", chapter,
+            family.c_str(), number, rel_dir.c_str(),
+            it->path().string().c_str());
+      groups[session_key(rel_dir, family, number)][chapter] = it->path().string();
+    }
+
+    if(groups.empty())
+    {
+      DEBUG("No GoPro videos found in %s\n", root.c_str());
+      return INGEST_NO_SESSIONS;
+    }
+
+    for(auto& g:groups)
+    {
+      session_t s;
+      const std::string& rel_dir = std::get<0>(g.first);
+      s.family = std::get<1>(g.first);
+      s.number = std::get<2>(g.first);
+
+      char session_name[16];
+      snprintf(session_name, sizeof(session_name), "%s%04u", s.family.c_str(), s.number);
+      s.name = rel_dir.empty() ? session_name : rel_dir + "/" + session_name;
+
+      // map is ordered by chapter index already
+      for(auto& c:g.second)
+        s.files.push_back(c.second);
+      sessions.push_back(s);
+    }
+
+    return INGEST_OK;
+  }
+
+  int32_t run_sessions(const std::vector<session_t>& sessions,
+                       uint32_t max_jobs, const session_job& job,
+                       bool verbose)
+  {
+    bool _verbose = verbose;
+    if(max_jobs == 0)
+      max_jobs = 1;
+
+    std::map<pid_t, const session_t*> running;
+    uint32_t failed = 0;
+
+    // waits for one worker to finish and accounts for its result
+    auto reap = [&]()
+    {
+      int status = 0;
+      pid_t pid = waitpid(-1, &status, 0);
+      if(pid <= 0)
+      {
+        // lost track of our workers, so we can't trust any of them
+        std::cerr << "Can't wait for session workers." << std::endl;
+        failed += running.size();
+        running.clear();
+        return;
+      }
+      auto r = running.find(pid);
+      if(r == running.end())
+        return;
+      if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      {
+        std::cerr << "Session " << r->second->name << " failed." << std::endl;
+        failed++;
+      }
+      else
+      {
+        DEBUG("Session %s done.\n", r->second->name.c_str());
+      }
+      running.erase(r);
+    };
+
+    for(auto& s:sessions)
+    {
+      while(running.size() >= max_jobs)
+        reap();
+
+      // don't duplicate buffered output in the child
+      std::cout.flush();
+      std::cerr.flush();
+      fflush(NULL);
+
+      pid_t pid = fork();
+      if(pid < 0)
+      {
+        std::cerr << "Can't spawn worker for session " << s.name << std::endl;
+        while(!running.empty())
+          reap();
+        return INGEST_CANT_SPAWN;
+      }
+      else if(pid == 0)
+      {
+        // worker
+        int32_t ret = job(s);
+        std::cout.flush();
+        std::cerr.flush();
+        fflush(NULL);
+        _exit(ret ? 1 : 0);
+      }
+
+      DEBUG("Started session %s in worker %d.\n", s.name.c_str(), pid);
+      running[pid] = &s;
+    }
+
+    while(!running.empty())
+      reap();
+
+    if(failed)
+    {
+      std::cerr << failed << " of " << sessions.size() << " sessions failed." << std::endl;
+      return INGEST_SESSION_FAILED;
+    }
+
+    return INGEST_OK;
+  }
+
+}
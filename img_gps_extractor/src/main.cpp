@@ -6,6 +6,9 @@
 #include <iostream> 
 #include <string>
 #include <algorithm>    // std::sort
+#include <thread>
+#include <sstream>
+#include <memory>
 
 // boost program options to parse args
 #include "boost/program_options.hpp"
@@ -17,6 +20,22 @@ namespace fs = boost::filesystem;
 #include "gpmf_to_yaml.hpp"
 namespace gp_yml = gpmf_to_yaml;
 
+// multi-session ingest
+#include "ingest.hpp"
+
+// spatial index over the extracted images
+#include "spatial_index.hpp"
+
+// metadata output
+#include "metadata_writer.hpp"
+
+// watch folder daemon
+#include "watch_folder.hpp"
+#include <signal.h>
+
+// outputs swapped in when the run succeeds
+#include "output_staging.hpp"
+
 //config file
 #include "config.h"
 
@@ -24,6 +43,138 @@ namespace gp_yml = gpmf_to_yaml;
 std::string sep = "\n=========================================================";
 std::string sh_sep = "--------------";
 
+// converts all the files from one run (chapters of the same recording) into
+// output_dir, which has to exist already, at every frame rate (each one in
+// its directory, with its own metadata file and spatial index). The parser
+// can be reused across calls to keep its state warm.
+int convert_files(gp_yml::converter& parser,
+                  const std::vector<std::string>& files,
+                  const std::string& output_dir,
+                  const std::string& metadata_name,
+                  std::vector<gp_yml::rate_t> rates)
+{
+  int ret;
+
+  // Open the metadata files. Entries are streamed to them (compressed if the
+  // name asks for it) as each file is converted.
+  std::vector<std::unique_ptr<metadata_writer::writer>> out;
+  std::vector<metadata_writer::writer*> writers;
+  std::vector<std::string> filenames;
+  for(auto& r:rates)
+  {
+    std::string dir = r.dir.empty() ? output_dir : output_dir+"/"+r.dir;
+    boost::system::error_code ec;
+    fs::create_directories(dir,ec);
+    filenames.push_back(dir+"/"+metadata_name);
+    out.emplace_back(new metadata_writer::writer());
+    writers.push_back(out.back().get());
+    if(ec || out.back()->open(filenames.back()))
+    {
+      std::cerr << "ERROR creating " << filenames.back() << ". Exiting" << std::endl;
+      return gp_yml::CONV_CANT_CREATE_OUTPUT;
+    }
+  }
+
+  // spatial index of all the images in each output
+  std::vector<spatial_index::builder> index(rates.size());
+
+  //loop for all files in the file list and convert
+  for(auto& r:rates)
+    r.idx_offset=0;
+  for(auto& f:files)
+  {
+    // the parser goes on to the next file (or recording, in watch mode), so
+    // its state and source are cleaned up however this one ends
+    struct cleanup_guard
+    {
+      gp_yml::converter& parser;
+      ~cleanup_guard() { parser.cleanup(); }
+    } guard = {parser};
+
+    // init the conversion
+    std::cout << sep << std::endl;
+    std::cout << "Init conversion for file: " << f << std::endl;
+    std::cout << sh_sep << std::endl;
+    ret = parser.init(f,output_dir,rates);
+    if(ret)
+    {
+      std::cerr << "ERROR initializing conversion. Exiting" << std::endl;
+      std::cout << sep << std::endl;
+      parser.finish();
+      return gp_yml::CONV_ERROR;
+    }
+
+    // run the conversion
+    std::cout << std::endl << "Run conversion" << std::endl
+              << sh_sep << std::endl;
+    ret = parser.run(writers);
+    if(ret)
+    {
+      std::cerr << "ERROR running conversion. Exiting" << std::endl;
+      std::cout << sep << std::endl;
+      parser.finish();
+      return gp_yml::CONV_ERROR;
+    }
+
+    // index the images by position (by the number they were saved as).
+    // Without at least a 2D fix the position is 0,0 or stale, so those are
+    // left out (they are only extracted with --min-fix below 2).
+    for(size_t r = 0; r < rates.size(); r++)
+    {
+      for(auto& sf:parser.get_sensorframes(r))
+      {
+        const sc::record<sc::gps5>& gps = sf.sensors.get<sc::gps5>();
+        const sc::record<sc::gpsf>& fix = sf.sensors.get<sc::gpsf>();
+        if(!gps.valid || !fix.valid || fix.v[0] < 2)
+          continue;
+        index[r].add(sf.idx,gps.v[0],gps.v[1]);
+      }
+    }
+
+    std::cout << sep << std::endl;
+
+    // Get offsets to initialize next round (next file)
+    for(size_t r = 0; r < rates.size(); r++)
+      rates[r].idx_offset = parser.get_offset(r);
+  }
+
+  // finish the timelapse of the run (waits for the encoder)
+  if(parser.finish())
+  {
+    std::cerr << "ERROR writing the timelapse. Exiting" << std::endl;
+    return gp_yml::CONV_CANT_CREATE_OUTPUT;
+  }
+
+  for(size_t r = 0; r < rates.size(); r++)
+  {
+    // entries are written as the keys of one map, so a run without images
+    // is the empty map (what the emitter wrote), not an empty document
+    if(!out[r]->written() && out[r]->write("{}\n"))
+    {
+      std::cerr << "ERROR writing " << filenames[r] << ". Exiting" << std::endl;
+      return gp_yml::CONV_CANT_CREATE_OUTPUT;
+    }
+
+    // close the file (waits for the last compressed blocks)
+    if(out[r]->close())
+    {
+      std::cerr << "ERROR writing " << filenames[r] << ". Exiting" << std::endl;
+      return gp_yml::CONV_CANT_CREATE_OUTPUT;
+    }
+
+    // save the spatial index next to the yaml
+    std::string dir = rates[r].dir.empty() ? output_dir : output_dir+"/"+rates[r].dir;
+    std::cout << "Saving spatial index of " << index[r].size() << " images" << std::endl;
+    if(index[r].save(dir+"/spatial_index.bin"))
+    {
+      std::cerr << "ERROR saving spatial index. Exiting" << std::endl;
+      return gp_yml::CONV_ERROR;
+    }
+  }
+
+  return gp_yml::CONV_OK;
+}
+
 int main(int argc, char *argv[])
 {
   int ret;
@@ -31,7 +182,17 @@ int main(int argc, char *argv[])
 
   // arguments
   std::string input_file,input_directory,output_dir;
-  float framerate = 1; // 1Hz by default
+  std::vector<float> framerates(1,1); // 1Hz by default
+  std::vector<gp_yml::rate_t> rates; // and where each one goes
+  uint32_t jobs = std::thread::hardware_concurrency(); // sessions at a time
+  float settle_time = 30; // seconds without changes before converting
+  float start = 0, end = -1; // time range to extract (whole run by default)
+  uint32_t min_fix = 2; // GPSF images need (2D lock by default)
+  float max_precision = 0; // GPSP images need at most (any by default)
+  img_extr::BACKEND backend = img_extr::DEFAULT_BACKEND; // video decoder
+  std::string metadata_name = "metadata.yaml"; // .gz/.zst to compress
+  std::vector<img_extr::variant_t> variants; // extra image outputs
+  std::string timelapse_name; // video instead of images ("" for images)
 
   // parser for command line options
   po::options_description desc("Options"); 
@@ -40,8 +201,20 @@ int main(int argc, char *argv[])
     ("verbose,v", "Verbose") 
     ("input,i",po::value<std::string>(), "Input video with metadata")
     ("directory,d",po::value<std::string>(), "Input directory with partial metadata videos (from one run)")
+    ("ingest,r",po::value<std::string>(), "Input directory to search recursively for recordings (one output subtree each)")
+    ("jobs,j",po::value<uint32_t>(), "Max number of recordings converted at the same time in ingest mode")
+    ("watch,w",po::value<std::string>(), "Spool directory to watch, converting recordings as they land")
+    ("settle",po::value<float>(), "Seconds a recording has to stay unchanged in watch mode before converting it")
     ("output,o",po::value<std::string>(), "Output directory for yaml and images")
-    ("framerate,f",po::value<float>() ,"Frame rate for image extraction and metadata interpolation"); 
+    ("metadata,m",po::value<std::string>(), "Name of the yaml file in the output directory (metadata.yaml by default, end in .gz or .zst to compress it)")
+    ("framerate,f",po::value<std::vector<float>>()->multitoken()->composing() ,"Frame rate for image extraction and metadata interpolation. Several rates (-f 1 5 10) are extracted from one decode, each in its own subdirectory")
+    ("start",po::value<float>(), "Only extract from this many seconds into the run")
+    ("end",po::value<float>(), "Only extract up to this many seconds into the run")
+    ("min-fix",po::value<uint32_t>(), "Only extract images with this GPS fix: 2 for 2D lock (default), 3 for 3D, 0 for all")
+    ("max-precision",po::value<float>(), "Only extract images with a GPS precision (GPSP, DOP x100) of at most this")
+    ("backend",po::value<std::string>(), "Video decoder: opencv (default) or libav (if built with it)")
+    ("variant",po::value<std::vector<std::string>>()->composing(), "Extra output of every image, as size:format[:quality[:dir]] (size of the longest side in px, 0 for full size). Can be repeated")
+    ("timelapse",po::value<std::string>(), "Encode the images into this video in the output directory instead of saving them, with the metadata keyed by frame number"); 
 
   // parse args
   po::variables_map vm; 
@@ -58,14 +231,14 @@ int main(int argc, char *argv[])
     }
 
     // check for input video file
-    if(vm.count("input")==0 and vm.count("directory")==0)
+    if(vm.count("input")==0 and vm.count("directory")==0 and vm.count("ingest")==0 and vm.count("watch")==0)
     {
       std::cerr << "ERROR: Input file/directory is necessary. Exiting..." << std::endl;
       return gp_yml::CONV_INPUT_NON_EXISTENT;
     }
-    else if(vm.count("input") and vm.count("directory"))
+    else if(vm.count("input") + vm.count("directory") + vm.count("ingest") + vm.count("watch") > 1)
     {
-      std::cerr << "ERROR: Input file/directory are mutually exclusive. Exiting..." << std::endl;
+      std::cerr << "ERROR: Input file/directory/ingest/watch are mutually exclusive. Exiting..." << std::endl;
       return gp_yml::CONV_INPUT_NON_EXISTENT;
     }
     else if(vm.count("input"))
@@ -82,6 +255,28 @@ int main(int argc, char *argv[])
       input_directory.assign(vm["directory"].as<std::string>());
       std::cout << "Input directory: " << input_directory << std::endl;
     }
+    else if(vm.count("ingest"))
+    {
+      std::cout << sep << std::endl << "Program options:" << std::endl 
+                << sh_sep << std::endl; 
+      input_directory.assign(vm["ingest"].as<std::string>());
+      std::cout << "Ingest directory: " << input_directory << std::endl;
+      if(vm.count("jobs"))
+        jobs = vm["jobs"].as<uint32_t>();
+      if(jobs == 0)
+        jobs = 1;
+      std::cout << "Concurrent recordings: " << jobs << std::endl;
+    }
+    else if(vm.count("watch"))
+    {
+      std::cout << sep << std::endl << "Program options:" << std::endl 
+                << sh_sep << std::endl; 
+      input_directory.assign(vm["watch"].as<std::string>());
+      std::cout << "Watch directory: " << input_directory << std::endl;
+      if(vm.count("settle"))
+        settle_time = vm["settle"].as<float>();
+      std::cout << "Settle time: " << settle_time << "s" << std::endl;
+    }
 
     // check for output yaml file
     if(vm.count("output")==0)
@@ -91,43 +286,157 @@ int main(int argc, char *argv[])
     }
     else
     {
-      //name as desired by user
+      //name as desired by user. The run is written next to it and replaces
+      //it only once it succeeds (see below)
       output_dir.assign(vm["output"].as<std::string>());
       std::cout << "Output directory: " << output_dir << std::endl;
+    }
 
-      // check if directory exists
-      fs::path out_path(output_dir);
-      if(fs::is_directory(out_path))
+    // check for image variants
+    if(vm.count("variant"))
+    {
+      for(auto& arg:vm["variant"].as<std::vector<std::string>>())
       {
-        std::cout << "Erasing directory and creating new one..." << std::endl;
-        fs::remove_all(out_path);
-        if(fs::is_directory(out_path))
+        img_extr::variant_t v;
+        if(!img_extr::parse_variant(arg,v) || v.dir.find("..") != std::string::npos)
         {
-          std::cerr << "ERROR: Output directory can't be erased. Exiting..." << std::endl;
-          return gp_yml::CONV_OUTPUT_NON_EXISTENT;
+          std::cerr << "ERROR: Invalid variant " << arg << ". Exiting..." << std::endl;
+          return gp_yml::CONV_ERROR;
         }
+        // every variant needs its own files (the full size jpg is always there)
+        bool taken = v.dir.empty() && v.format == "jpg";
+        for(auto& o:variants)
+          taken |= o.dir == v.dir && o.format == v.format;
+        if(taken)
+        {
+          std::cerr << "ERROR: Variant " << arg << " would overwrite another one"
+                       " (give it a different format or dir). Exiting..." << std::endl;
+          return gp_yml::CONV_ERROR;
+        }
+        std::cout << "Image variant: " << (v.size ? std::to_string(v.size) + "px " : "full size ")
+                  << v.format << " in " << (v.dir.empty() ? "." : v.dir) << std::endl;
+        variants.push_back(v);
       }
+    }
 
-      //create directory
-      if(!fs::create_directory(out_path))
+    // check for timelapse output
+    if(vm.count("timelapse"))
+    {
+      timelapse_name = vm["timelapse"].as<std::string>();
+      if(timelapse_name.empty() || timelapse_name.find('/') != std::string::npos)
       {
-        std::cerr << "ERROR: Output directory can't be created. Exiting..." << std::endl;
-        return gp_yml::CONV_OUTPUT_NON_EXISTENT;
-      } 
+        std::cerr << "ERROR: Timelapse name has to be a file name. Exiting..." << std::endl;
+        return gp_yml::CONV_ERROR;
+      }
+      if(!variants.empty())
+      {
+        std::cerr << "ERROR: Variants are images, they can't go with a timelapse. Exiting..." << std::endl;
+        return gp_yml::CONV_ERROR;
+      }
+      std::cout << "Timelapse: " << timelapse_name << std::endl;
+    }
+
+    // check for metadata file name
+    if(vm.count("metadata"))
+    {
+      metadata_name = vm["metadata"].as<std::string>();
+      if(metadata_name.empty() || metadata_name.find('/') != std::string::npos)
+      {
+        std::cerr << "ERROR: Metadata name has to be a file name. Exiting..." << std::endl;
+        return gp_yml::CONV_ERROR;
+      }
     }
+    std::cout << "Metadata file: " << metadata_name << std::endl;
 
     // check for frame-rate yaml
     if(vm.count("framerate")==0)
     {
       //use default
-      std::cout << "Frame-rate: " << framerate << " fps (default)" << std::endl;  
+      std::cout << "Frame-rate: " << framerates[0] << " fps (default)" << std::endl;  
     }
     else
     {
-      // frame-rate desired by user
-      framerate = vm["framerate"].as<float>();
-      std::cout << "Frame-rate: " << framerate << " fps" << std::endl;  
+      // frame-rates desired by user
+      framerates = vm["framerate"].as<std::vector<float>>();
+      for(auto fr:framerates)
+      {
+        if(!(fr > 0))
+        {
+          std::cerr << "ERROR: Invalid frame-rate " << fr << ". Exiting..." << std::endl;
+          return gp_yml::CONV_ERROR;
+        }
+        std::cout << "Frame-rate: " << fr << " fps" << std::endl;  
+      }
+    }
+
+    // a single rate goes to the output directory itself, several to a
+    // subdirectory each (named like 2.5fps)
+    for(auto fr:framerates)
+    {
+      gp_yml::rate_t rate = {fr, "", 0};
+      if(framerates.size() > 1)
+      {
+        std::ostringstream dir;
+        dir << fr << "fps";
+        rate.dir = dir.str();
+        std::cout << "Frame-rate " << fr << " fps in " << rate.dir << std::endl;
+      }
+      for(auto& r:rates)
+      {
+        if(r.dir == rate.dir)
+        {
+          std::cerr << "ERROR: Frame-rate " << fr << " is given twice. Exiting..." << std::endl;
+          return gp_yml::CONV_ERROR;
+        }
+      }
+      rates.push_back(rate);
+    }
+
+    // check for time range
+    if(vm.count("start"))
+      start = vm["start"].as<float>();
+    if(vm.count("end"))
+      end = vm["end"].as<float>();
+    if(start < 0 || (end >= 0 && end < start))
+    {
+      std::cerr << "ERROR: Invalid time range. Exiting..." << std::endl;
+      return gp_yml::CONV_ERROR;
+    }
+    if(vm.count("start") || vm.count("end"))
+    {
+      std::cout << "Time range: " << start << "s to ";
+      if(end < 0)
+        std::cout << "end" << std::endl;
+      else
+        std::cout << end << "s" << std::endl;
     }
+
+    // check for gps fix gating
+    if(vm.count("min-fix"))
+      min_fix = vm["min-fix"].as<uint32_t>();
+    if(vm.count("max-precision"))
+      max_precision = vm["max-precision"].as<float>();
+    if(max_precision < 0)
+    {
+      std::cerr << "ERROR: Invalid GPS precision. Exiting..." << std::endl;
+      return gp_yml::CONV_ERROR;
+    }
+    std::cout << "Min GPS fix: " << min_fix << std::endl;
+    if(max_precision > 0)
+      std::cout << "Max GPS precision: " << max_precision << std::endl;
+
+    // check for decoder backend
+    if(vm.count("backend"))
+    {
+      std::string name = vm["backend"].as<std::string>();
+      if(!img_extr::parse_backend(name,backend) || !img_extr::backend_available(backend))
+      {
+        std::cerr << "ERROR: Backend " << name << " is not available. Exiting..." << std::endl;
+        return gp_yml::CONV_ERROR;
+      }
+    }
+    std::cout << "Decoder backend: "
+              << (backend == img_extr::BACKEND_LIBAV ? "libav" : "opencv") << std::endl;
     std::cout << sep << std::endl;
 
     // verbose output
@@ -161,7 +470,7 @@ int main(int argc, char *argv[])
     std::cout << "Using single input file: " << input_file << std::endl;
     files.push_back(input_file);
   }
-  else //directory
+  else if(vm.count("directory"))
   {
     // get dir
     fs::path in_path(input_directory);
@@ -199,58 +508,150 @@ int main(int argc, char *argv[])
     }
   }
 
-  // Open the metadata file and start the map
-  // create yaml file
-  YAML::Emitter out;
-  std::fstream fs;
-  std::string filename=output_dir+"/metadata.yaml";
-  fs.open(filename, std::fstream::out);
-  out << YAML::BeginMap;
+  // settings common to all the converters we create
+  auto configure = [&](gp_yml::converter& parser)
+  {
+    parser.set_range(start,end);
+    parser.set_fix_gate(min_fix,max_precision);
+    parser.set_backend(backend);
+    for(auto& v:variants)
+      parser.add_variant(v);
+    parser.set_timelapse(timelapse_name);
+  };
 
-  // create a converter instance
-  gp_yml::converter parser(verbose);
+  // outputs replaced by this run are deleted in the background, and what is
+  // left when we exit is deleted by the next run
+  output_staging::remover trash(verbose);
 
-  //loop for all files in the file list and convert
-  uint32_t offset=0;
-  for(auto& f:files)
+  // ingest forks its workers, which can't inherit a running thread, so the
+  // deleting waits until they are done
+  if(vm.count("ingest"))
+    trash.hold();
+
+  // the output is written to a staging directory next to it, and only
+  // replaces the previous one if the whole run succeeds (the watch mode
+  // does it for every recording instead)
+  output_staging::staged_dir staged(output_dir,trash,verbose);
+  std::string work_dir = output_dir;
+  if(!vm.count("watch"))
   {
-    // init the conversion
-    std::cout << sep << std::endl;
-    std::cout << "Init conversion for file: " << f << std::endl;
-    std::cout << sh_sep << std::endl;
-    ret = parser.init(f,output_dir,framerate,offset);
+    if(staged.open())
+    {
+      std::cerr << "ERROR: Output directory can't be created. Exiting..." << std::endl;
+      return gp_yml::CONV_OUTPUT_NON_EXISTENT;
+    }
+    work_dir = staged.path();
+  }
+  auto commit = [&](int result) -> int
+  {
+    if(result)
+      return result; // the previous output stays
+    if(staged.commit())
+    {
+      std::cerr << "ERROR: Output can't be moved to " << output_dir << ". Exiting..." << std::endl;
+      return gp_yml::CONV_OUTPUT_NON_EXISTENT;
+    }
+    return gp_yml::CONV_OK;
+  };
+
+  // ingest mode: every recording found goes to its own output subtree
+  if(vm.count("ingest"))
+  {
+    std::vector<ingest::session_t> sessions;
+    ret = ingest::discover_sessions(input_directory,sessions,verbose);
     if(ret)
     {
-      std::cerr << "ERROR initializing conversion. Exiting" << std::endl;
-      std::cout << sep << std::endl;
-      return gp_yml::CONV_ERROR;
+      std::cerr << "ERROR discovering recordings in " << input_directory 
+                << ". Exiting" << std::endl;
+      return gp_yml::CONV_INPUT_NON_EXISTENT;
     }
 
-    // run the conversion
-    std::cout << std::endl << "Run conversion" << std::endl
-              << sh_sep << std::endl;
-    ret = parser.run(out);
+    std::cout << "Found " << sessions.size() << " recordings:" << std::endl;
+    for(auto& s:sessions)
+    {
+      std::cout << "Session: " << s.name << std::endl;
+      for(auto& f:s.files)
+        std::cout << "  File: " << f << std::endl;
+    }
+
+    // each worker converts one session into its subtree
+    ingest::session_job job = [&](const ingest::session_t& s) -> int32_t
+    {
+      fs::path session_path = fs::path(work_dir) / s.name;
+      boost::system::error_code ec;
+      fs::create_directories(session_path,ec);
+      if(ec)
+      {
+        std::cerr << "ERROR: Output directory " << session_path.string()
+                  << " can't be created. Exiting..." << std::endl;
+        return gp_yml::CONV_OUTPUT_NON_EXISTENT;
+      }
+      gp_yml::converter parser(verbose);
+      configure(parser);
+      return convert_files(parser,s.files,session_path.string(),metadata_name,rates);
+    };
+
+    ret = ingest::run_sessions(sessions,jobs,job,verbose);
+    trash.resume();
     if(ret)
     {
-      std::cerr << "ERROR running conversion. Exiting" << std::endl;
-      std::cout << sep << std::endl;
+      std::cerr << "ERROR running ingest. Exiting" << std::endl;
       return gp_yml::CONV_ERROR;
     }
-    // cleanup
-    parser.cleanup();
-    
-    std::cout << sep << std::endl;
+    return commit(gp_yml::CONV_OK);
+  }
 
-    // Get offset to initialize next round (next file)
-    offset = parser.get_offset();
+  // watch mode: convert every recording that lands in the spool directory,
+  // reusing the same converter for all of them
+  if(vm.count("watch"))
+  {
+    boost::system::error_code ec;
+    fs::create_directories(output_dir,ec);
+    if(ec)
+    {
+      std::cerr << "ERROR: Output directory can't be created. Exiting..." << std::endl;
+      return gp_yml::CONV_OUTPUT_NON_EXISTENT;
+    }
+
+    gp_yml::converter parser(verbose);
+    configure(parser);
+    ingest::session_job job = [&](const ingest::session_t& s) -> int32_t
+    {
+      // recordings can be converted again if they change, so each one is
+      // staged and replaces its previous output when done
+      fs::path session_path = fs::path(output_dir) / s.name;
+      output_staging::staged_dir session(session_path.string(),trash,verbose);
+      if(session.open())
+      {
+        std::cerr << "ERROR: Output directory " << session_path.string()
+                  << " can't be created." << std::endl;
+        return gp_yml::CONV_OUTPUT_NON_EXISTENT;
+      }
+      int32_t result = convert_files(parser,s.files,session.path(),metadata_name,rates);
+      if(result)
+        return result;
+      return session.commit() ? gp_yml::CONV_OUTPUT_NON_EXISTENT : gp_yml::CONV_OK;
+    };
+
+    watch_folder::watcher watcher(input_directory,settle_time,verbose);
+    ret = watcher.init();
+    if(ret)
+    {
+      std::cerr << "ERROR watching " << input_directory << ". Exiting" << std::endl;
+      return gp_yml::CONV_INPUT_NON_EXISTENT;
+    }
+
+    // finish the current recording and exit on ctrl-c or kill
+    signal(SIGINT,[](int){ watch_folder::watcher::stop(); });
+    signal(SIGTERM,[](int){ watch_folder::watcher::stop(); });
+
+    ret = watcher.run(job);
+    return ret ? gp_yml::CONV_ERROR : gp_yml::CONV_OK;
   }
 
-  // output yaml to file
-  out << YAML::EndMap;
-  fs << out.c_str();
-  // close the file
-  fs.close();
   //exit
-  return gp_yml::CONV_OK;
+  gp_yml::converter parser(verbose);
+  configure(parser);
+  return commit(convert_files(parser,files,work_dir,metadata_name,rates));
   
 }
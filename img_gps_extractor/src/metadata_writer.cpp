@@ -0,0 +1,281 @@
+/*
+ * Metadata writer
+ *
+ * Streams the metadata document to disk as it is produced, optionally
+ * compressed in parallel blocks.
+ *
+ */
+
+// class definitions
+#include "metadata_writer.hpp"
+
+// basic stuff
+#include <iostream>
+#include <algorithm>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace metadata_writer
+{
+
+  static bool ends_with(const std::string& s, const std::string& suffix)
+  {
+    return s.size() >= suffix.size() &&
+           s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+
+  COMPRESSION compression_for(const std::string& path)
+  {
+    if(ends_with(path, ".gz"))
+      return COMPRESS_GZIP;
+    if(ends_with(path, ".zst"))
+      return COMPRESS_ZSTD;
+    return COMPRESS_NONE;
+  }
+
+  writer::writer(bool verbose):_file(NULL),_compression(COMPRESS_NONE),
+                               _written(0),_verbose(verbose),_ret(WRITER_OK),
+                               _max_blocks(0),_stop(false)
+  {
+  }
+
+  writer::~writer()
+  {
+    close();
+  }
+
+  int32_t writer::open(const std::string& path, int32_t threads)
+  {
+    close();
+
+    _compression = compression_for(path);
+#ifndef WITH_ZLIB
+    if(_compression == COMPRESS_GZIP)
+    {
+      std::cerr << "Built without zlib, can't write " << path << std::endl;
+      return WRITER_UNSUPPORTED;
+    }
+#endif
+#ifndef WITH_ZSTD
+    if(_compression == COMPRESS_ZSTD)
+    {
+      std::cerr << "Built without zstd, can't write " << path << std::endl;
+      return WRITER_UNSUPPORTED;
+    }
+#endif
+
+    _file = fopen(path.c_str(), "wb");
+    if(_file == NULL)
+    {
+      std::cerr << "Can't open " << path << std::endl;
+      return WRITER_CANT_OPEN;
+    }
+    _ret = WRITER_OK;
+    _written = 0;
+    _buffer.clear();
+    _buffer.reserve(BLOCK_SIZE);
+
+    // plain text goes straight through, only compression needs workers
+    if(_compression != COMPRESS_NONE)
+    {
+      if(threads <= 0)
+        threads = std::thread::hardware_concurrency();
+      if(threads <= 0)
+        threads = 1;
+      _max_blocks = 2 * threads;
+      _stop = false;
+      for(int32_t i = 0; i < threads; i++)
+        _workers.push_back(std::thread(&writer::worker, this));
+      DEBUG("Writing %s compressed with %d threads\n", path.c_str(), threads);
+    }
+
+    return WRITER_OK;
+  }
+
+  int32_t writer::write(const char *data, size_t size)
+  {
+    if(_file == NULL)
+      return WRITER_ERROR;
+    _written += size;
+
+    if(_compression == COMPRESS_NONE)
+    {
+      if(fwrite(data, 1, size, _file) != size)
+        _ret = WRITER_CANT_WRITE;
+      return _ret;
+    }
+
+    while(size > 0)
+    {
+      size_t n = std::min(size, BLOCK_SIZE - _buffer.size());
+      _buffer.append(data, n);
+      data += n;
+      size -= n;
+      if(_buffer.size() == BLOCK_SIZE && submit())
+        return _ret;
+    }
+    return _ret;
+  }
+
+  int32_t writer::write(const std::string& text)
+  {
+    return write(text.data(), text.size());
+  }
+
+  int32_t writer::close()
+  {
+    if(_file == NULL)
+      return _ret;
+
+    if(_compression != COMPRESS_NONE)
+    {
+      // last partial block, then wait for all of them
+      if(!_buffer.empty())
+        submit();
+      drain(0);
+
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+      }
+      _work_cv.notify_all();
+      for(auto& t:_workers)
+        t.join();
+      _workers.clear();
+      _blocks.clear();
+      _todo.clear();
+    }
+    _buffer.clear();
+
+    if(fclose(_file) != 0 && _ret == WRITER_OK)
+      _ret = WRITER_CANT_WRITE;
+    _file = NULL;
+
+    return _ret;
+  }
+
+  int32_t writer::submit()
+  {
+    std::shared_ptr<block_t> block(new block_t);
+    block->in.swap(_buffer);
+    block->done = false;
+    block->ok = false;
+    _buffer.reserve(BLOCK_SIZE);
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _blocks.push_back(block);
+      _todo.push_back(block);
+    }
+    _work_cv.notify_one();
+
+    // write what is ready, and wait if too many blocks are in flight
+    return drain(_max_blocks);
+  }
+
+  int32_t writer::drain(size_t keep)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while(!_blocks.empty())
+    {
+      std::shared_ptr<block_t> block = _blocks.front();
+      if(!block->done)
+      {
+        if(_blocks.size() <= keep)
+          break;
+        _done_cv.wait(lock);
+        continue;
+      }
+      _blocks.pop_front();
+
+      // write in order, outside the lock so workers keep going
+      lock.unlock();
+      if(!block->ok)
+      {
+        if(_ret == WRITER_OK)
+          _ret = WRITER_ERROR;
+      }
+      else if(_ret == WRITER_OK &&
+              fwrite(block->out.data(), 1, block->out.size(), _file) != block->out.size())
+      {
+        _ret = WRITER_CANT_WRITE;
+      }
+      lock.lock();
+    }
+    return _ret;
+  }
+
+  void writer::worker()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while(true)
+    {
+      while(_todo.empty() && !_stop)
+        _work_cv.wait(lock);
+      if(_todo.empty())
+        return;
+      std::shared_ptr<block_t> block = _todo.front();
+      _todo.pop_front();
+
+      lock.unlock();
+      bool ok = compress(*block);
+      block->in.clear();
+      lock.lock();
+
+      block->ok = ok;
+      block->done = true;
+      _done_cv.notify_all();
+    }
+  }
+
+  bool writer::compress(block_t& block)
+  {
+    switch(_compression)
+    {
+#ifdef WITH_ZLIB
+      case COMPRESS_GZIP:
+      {
+        // one complete gzip member per block
+        z_stream zs;
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+        if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                        Z_DEFAULT_STRATEGY) != Z_OK)
+          return false;
+        // gzip header and trailer on top of the deflate bound
+        block.out.resize(deflateBound(&zs, block.in.size()) + 18);
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(block.in.data()));
+        zs.avail_in = block.in.size();
+        zs.next_out = reinterpret_cast<Bytef*>(&block.out[0]);
+        zs.avail_out = block.out.size();
+        int ret = deflate(&zs, Z_FINISH);
+        block.out.resize(zs.total_out);
+        deflateEnd(&zs);
+        return ret == Z_STREAM_END;
+      }
+#endif
+#ifdef WITH_ZSTD
+      case COMPRESS_ZSTD:
+      {
+        // one complete zstd frame per block
+        block.out.resize(ZSTD_compressBound(block.in.size()));
+        size_t n = ZSTD_compress(&block.out[0], block.out.size(),
+                                 block.in.data(), block.in.size(), 3);
+        if(ZSTD_isError(n))
+          return false;
+        block.out.resize(n);
+        return true;
+      }
+#endif
+      default:
+        return false;
+    }
+  }
+
+}
@@ -8,47 +8,146 @@
  * 
  */
 
-#include <ctime>
+#include <chrono>
+#include <stdlib.h>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <fstream>
 #include "mp4_img_extractor.hpp"
 
+// create the variant directories
+#include "boost/filesystem.hpp"
+namespace fs = boost::filesystem;
+
 namespace mp4_img_extractor
 {
-  img_extractor::img_extractor(bool verbose):_verbose(verbose)
+
+  // the image the metadata refers to
+  static const variant_t FULL_SIZE = {0, "jpg", -1, ""};
+
+  bool parse_variant(const std::string& arg, variant_t& variant)
+  {
+    std::vector<std::string> fields;
+    std::stringstream ss(arg);
+    std::string item;
+    while(std::getline(ss, item, ':'))
+      fields.push_back(item);
+    if(fields.size() < 2 || fields.size() > 4 || fields[1].empty())
+      return false;
+
+    char *end;
+    long size = strtol(fields[0].c_str(), &end, 10);
+    if(fields[0].empty() || *end != 0 || size < 0)
+      return false;
+    variant.size = size;
+    variant.format = fields[1];
+    variant.quality = -1;
+    if(fields.size() > 2 && !fields[2].empty())
+    {
+      long quality = strtol(fields[2].c_str(), &end, 10);
+      if(*end != 0 || quality < 0 || quality > 100)
+        return false;
+      variant.quality = quality;
+    }
+    variant.dir = fields.size() > 3 ? fields[3] : "";
+    return true;
+  }
+  img_extractor::img_extractor(bool verbose):_verbose(verbose),
+                                             _backend(DEFAULT_BACKEND),
+                                             _frame_num(-1),_frame_ts(0),
+                                             _duration(0),_encoding(0)
   {
+    _variants.push_back(FULL_SIZE);
+    set_outputs(std::vector<std::string>(1));
   }
 
   img_extractor::img_extractor(const std::string& in,
                                const std::string& out_dir,
                                bool verbose):
                                _input(in),_output_dir(out_dir),
-                               _verbose(verbose),_cap(_input)
+                               _verbose(verbose),_backend(DEFAULT_BACKEND),
+                               _frame_num(-1),_frame_ts(0),_duration(0),_encoding(0)
   {
+    _variants.push_back(FULL_SIZE);
+    set_outputs(std::vector<std::string>(1));
   }
 
   img_extractor::~img_extractor()
   {
+    if(_encode_queue)
+      _encode_queue->close();
+    for(auto& t:_encoders)
+      t.join();
+  }
+
+  void img_extractor::start_encoders(size_t n)
+  {
+    if(!_encode_queue)
+      _encode_queue.reset(new pipeline::bounded_queue<encode_t>(n));
+    while(_encoders.size() < n)
+      _encoders.push_back(std::thread(&img_extractor::encoder, this));
+  }
+
+  void img_extractor::encoder()
+  {
+    encode_t e;
+    while(_encode_queue->pop(e))
+    {
+      *e.ok = save_variant(_variants[e.variant],*e.dir,*e.stem,*e.app1);
+      std::lock_guard<std::mutex> lock(_encode_mutex);
+      if(--_encoding == 0)
+        _encoded.notify_one();
+    }
   }
   
   int32_t img_extractor::init()
   {
-    if(!_cap.isOpened())
+    // every output, and every variant with its own directory in them, needs
+    // it to exist
+    for(size_t o = 0; o < _outputs.size(); o++)
+    {
+      for(auto& v:_variants)
+      {
+        std::string dir = v.dir.empty() ? output_dir(o) : output_dir(o) + "/" + v.dir;
+        boost::system::error_code ec;
+        if(!fs::create_directories(dir, ec) && ec)
+        {
+          std::cerr << "Can't create " << dir << std::endl;
+          return EXTR_ERROR;
+        }
+      }
+    }
+
+    // init(in,out) already opened this video
+    if(_decoder && _opened == _input)
+    {
+      return EXTR_OK;
+    }
+
+    // open the video with the selected backend, and fall back to opencv if
+    // that one can't handle it
+    _decoder.reset(create_decoder(_backend,_verbose));
+    _frame_num = -1;
+    int32_t ret = _decoder ? _decoder->open(_input) : EXTR_CANT_LOAD_VIDEO;
+    if(ret && _backend != BACKEND_OPENCV)
+    {
+      std::cerr << "Can't decode " << _input << " with the selected backend,"
+                   " falling back to opencv." << std::endl;
+      _decoder.reset(create_decoder(BACKEND_OPENCV,_verbose));
+      ret = _decoder->open(_input);
+    }
+    if(ret)
     {
       // error!
       DEBUG("Can not load video. Exiting...\n");
+      _decoder.reset();
+      _opened.clear();
       return EXTR_CANT_LOAD_VIDEO;
     }
-    else
-    {
-      // Success!
-      DEBUG("Opened cv capture successfully...\n");
-    }
+    _opened = _input;
 
-    float frames = _cap.get(CV_CAP_PROP_FRAME_COUNT);
-    DEBUG("There are %f frames in the video.\n",frames);
-    float fps = _cap.get(CV_CAP_PROP_FPS);
-    DEBUG("Fps is %f for video.\n",fps);
-    _duration = frames / fps;
-    DEBUG("Duration of video is %f.\n",_duration);
+    _duration = _decoder->duration();
 
     return EXTR_OK;
   }
@@ -57,19 +156,76 @@ namespace mp4_img_extractor
   {
     _input = in;
     _output_dir = out_dir;
-    _cap.release();
-    _cap = cv::VideoCapture(_input);
+    _decoder.reset(); // always reopen, the file may have changed
 
     // init
     int ret = init();
 
     return ret;
   }
+
+  void img_extractor::add_variant(const variant_t& variant)
+  {
+    _variants.push_back(variant);
+  }
+
+  void img_extractor::set_outputs(const std::vector<std::string>& dirs)
+  {
+    // the timelapses span files, so only restart them if the outputs change
+    if(dirs == _outputs)
+      return;
+    finish();
+    _outputs = dirs;
+    _timelapse.clear();
+    for(size_t o = 0; o < _outputs.size(); o++)
+      _timelapse.emplace_back(new timelapse_writer(_verbose));
+  }
+
+  std::string img_extractor::output_dir(size_t output)
+  {
+    return _outputs[output].empty() ? _output_dir : _output_dir + "/" + _outputs[output];
+  }
+
+  void img_extractor::set_timelapse(const std::string& name)
+  {
+    finish();
+    _timelapse_name = name;
+  }
+
+  int32_t img_extractor::finish()
+  {
+    int32_t ret = EXTR_OK;
+    for(auto& t:_timelapse)
+    {
+      if(t->close())
+        ret = EXTR_ERROR;
+    }
+    return ret;
+  }
+
+  gpmf_source::source* img_extractor::gpmf()
+  {
+    return _decoder ? _decoder->gpmf() : NULL;
+  }
+
+  int32_t img_extractor::set_backend(BACKEND backend)
+  {
+    if(!backend_available(backend))
+      return EXTR_ERROR;
+    if(backend != _backend)
+      _decoder.reset(); // reopen with the new one on next init
+    _backend = backend;
+    return EXTR_OK;
+  }
   
 
-  // gets the frame closest to ts and returns the real ts extracted and 
-  // the filename
-  int32_t img_extractor::get_frame(float ts, float & real_ts, uint32_t idx, std::string &name)
+  float img_extractor::get_duration()
+  {
+    return _duration;
+  }
+
+  // gets the frame closest to ts and returns the real ts extracted
+  int32_t img_extractor::get_frame(float ts, float & real_ts)
   {
     int ret = EXTR_OK;
 
@@ -80,67 +236,175 @@ namespace mp4_img_extractor
       return EXTR_CANT_FRAME_OUT_OF_BOUNDS;
     }
 
-    // timestamp comes in seconds, and opencv works in ms, so convert:
-    float timestamp = ts * 1000;
+    if(!_decoder)
+    {
+      return EXTR_CANT_LOAD_VIDEO;
+    }
 
-    // set the timestamp in video to obtain frame
-    _cap.set(CV_CAP_PROP_POS_MSEC,timestamp);
-    DEBUG("Setting timestamp to %.5f\n",timestamp);
+    // several frame rates can land on the same frame, which is decoded once
+    int64_t frame = _decoder->frame_at(ts);
+    if(frame >= 0 && frame == _frame_num)
+    {
+      DEBUG("Frame %ld is already decoded\n",frame);
+      real_ts = _frame_ts;
+      return EXTR_OK;
+    }
 
-    // get real timestamp to return
-    real_ts = _cap.get(CV_CAP_PROP_POS_MSEC);
-    DEBUG("Real timestamp set to %.5f\n",real_ts);
-  
     // get frame
-    std::clock_t begin_time = std::clock();
-    _cap >> _frame;
+    auto begin_time = std::chrono::steady_clock::now();
+    _frame_num = -1;
+    ret = _decoder->read(ts,_frame,real_ts);
+    if(ret)
+    {
+      return ret;
+    }
+    _frame_num = frame;
+    _frame_ts = real_ts;
+    DEBUG("Real timestamp set to %.5f\n",real_ts);
+    DEBUG("Time decoding frame: %f\n",
+          std::chrono::duration<float>(std::chrono::steady_clock::now() - begin_time).count());
+
+    return ret;
+  }
+
+  // file name without extension: the number with 6 digits (assume less
+  // than 1 million imgs), padded with 0's
+  static std::string frame_stem(uint32_t idx)
+  {
+    std::string stem = std::to_string(idx);
+    if(stem.length() < 6)
+      stem.insert(0, 6 - stem.length(), '0');
+    return stem;
+  }
+
+  std::string img_extractor::frame_name(uint32_t number) const
+  {
+    std::string stem = frame_stem(number);
+    return _timelapse_name.empty() ? stem + "." + FULL_SIZE.format : stem;
+  }
+
+  // saves the last decoded frame and returns the number it was saved as
+  int32_t img_extractor::save_frame(uint32_t idx, const exif_writer::gps_tags_t *tags,
+                                    uint32_t &number, size_t output)
+  {
+    int ret = EXTR_OK;
 
-    // if frame was not captured, try again n times
-    int tries=1;
-    while(_frame.empty() && tries<=50)
+    if(_frame.empty() || output >= _outputs.size())
     {
-      DEBUG("Frame skipped trying again for %d time: Real timestamp set to %.5f\n",tries,real_ts);
-      real_ts = _cap.get(CV_CAP_PROP_POS_MSEC);
-      _cap >> _frame;
-      tries++;
+      return EXTR_ERROR;
     }
+    std::string dir = output_dir(output);
 
-    // 50 times is an exaggeration, if it still didn't work, something is wrong,
-    // report back to user.
-    if(_frame.empty())
+    // timelapse: the frame is named by its number in the video, and encoded
+    // in the background
+    timelapse_writer& timelapse = *_timelapse[output];
+    if(!_timelapse_name.empty())
     {
-      std::cerr << "Skipping frame at " << real_ts << "ms. Exiting" <<std::endl;
-      return EXTR_SKIPPING_FRAME;
+      if(!timelapse.is_open())
+        timelapse.open(dir + "/" + _timelapse_name);
+      number = timelapse.frames();
+      return timelapse.write(_frame);
     }
+    number = idx;
+    std::string stem = frame_stem(idx);
 
-    DEBUG("Time cv cap>>frame: %f\n",float(clock()-begin_time)/CLOCKS_PER_SEC);
+    // same exif segment for every jpeg of the frame
+    std::string app1;
+    if(tags)
+      app1 = exif_writer::app1_segment(*tags);
 
-    // create filename as real ts with 6 digits(assume less than 1 million imgs)
-    // pad with 0's
-    name = std::to_string(idx);
-    int zero_pad = 6 - name.length();
-    int i = 0;
-    while(i < zero_pad)
+    // resize and encode the frame for every variant in parallel, from this
+    // one decode: the extra ones on the encoder threads, the first one here
+    auto begin_time = std::chrono::steady_clock::now();
+    std::vector<char> ok(_variants.size(), false);
+    size_t extra = _variants.size() - 1;
+    if(extra > 0)
+    {
+      start_encoders(extra);
+      {
+        std::lock_guard<std::mutex> lock(_encode_mutex);
+        _encoding = extra;
+      }
+      for(size_t v = 1; v < _variants.size(); v++)
+      {
+        encode_t e = {v, &dir, &stem, &app1, &ok[v]};
+        _encode_queue->push(e);
+      }
+    }
+    ok[0] = save_variant(_variants[0],dir,stem,app1);
     {
-      name = '0' + name;
-      i++;
+      // the frame stays until every variant is saved
+      std::unique_lock<std::mutex> lock(_encode_mutex);
+      while(extra > 0 && _encoding > 0)
+        _encoded.wait(lock);
     }
+    DEBUG("Time saving %lu variants: %f\n",_variants.size(),
+          std::chrono::duration<float>(std::chrono::steady_clock::now() - begin_time).count());
 
-    // generate the path
-    name+=".jpg";
-    std::string save_path = _output_dir + "/" + name;
+    for(size_t v = 0; v < _variants.size(); v++)
+    {
+      if(!ok[v])
+      {
+        std::cerr << "Can't save " << stem << "." << _variants[v].format
+                  << " in " << dir << "/" << _variants[v].dir << std::endl;
+        ret = EXTR_ERROR;
+      }
+    }
 
-    // write the frame
-    DEBUG("Saving image in %s\n", save_path.c_str());
-    begin_time = std::clock();
-    cv::imwrite(save_path,_frame);
-    DEBUG("Time cv::imwrite: %f\n",float(clock()-begin_time)/CLOCKS_PER_SEC);
+    return ret;
 
-    // return real_ts in seconds again
-    real_ts /= 1000;
+  }
 
-    return ret;
+  bool img_extractor::save_variant(const variant_t& variant, const std::string& dir,
+                                   const std::string& stem, const std::string& app1)
+  {
+    // area interpolation down to the variant size (never upscaled)
+    const cv::Mat *img = &_frame;
+    cv::Mat resized;
+    int longest = std::max(_frame.cols, _frame.rows);
+    if(variant.size > 0 && static_cast<int>(variant.size) < longest)
+    {
+      double f = static_cast<double>(variant.size) / longest;
+      cv::Size size(std::max(1, static_cast<int>(_frame.cols * f + 0.5)),
+                    std::max(1, static_cast<int>(_frame.rows * f + 0.5)));
+      cv::resize(_frame, resized, size, 0, 0, cv::INTER_AREA);
+      img = &resized;
+    }
+
+    std::vector<int> params;
+    if(variant.quality >= 0)
+    {
+      if(variant.format == "jpg" || variant.format == "jpeg")
+        params = {cv::IMWRITE_JPEG_QUALITY, variant.quality};
+      else if(variant.format == "png")
+        params = {cv::IMWRITE_PNG_COMPRESSION, std::min(variant.quality, 9)};
+      else if(variant.format == "webp")
+        params = {cv::IMWRITE_WEBP_QUALITY, std::max(variant.quality, 1)};
+    }
 
+    std::string save_path = (variant.dir.empty() ? dir : dir + "/" + variant.dir) +
+                            "/" + stem + "." + variant.format;
+    DEBUG("Saving image in %s\n", save_path.c_str());
+    try
+    {
+      bool jpeg = variant.format == "jpg" || variant.format == "jpeg";
+      if(app1.empty() || !jpeg)
+        return cv::imwrite(save_path, *img, params);
+
+      // encode to memory and add the exif segment, so the file is written
+      // once and already tagged
+      std::vector<unsigned char> buf;
+      if(!cv::imencode("." + variant.format, *img, buf, params) ||
+         !exif_writer::insert_app1(buf, app1))
+        return false;
+      std::ofstream file(save_path.c_str(), std::ios::binary);
+      file.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+      return file.good();
+    }
+    catch(cv::Exception& e)
+    {
+      return false;
+    }
   }
 
 }
\ No newline at end of file
@@ -0,0 +1,277 @@
+/*
+ * Output staging
+ *
+ * Staging directories swapped into place with a rename, and the background
+ * removal of the trees they replace.
+ *
+ */
+
+// class definitions
+#include "output_staging.hpp"
+
+// basic stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <iostream>
+
+// thread priority, renameat2
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+// boost filesystem to walk the trees
+#include "boost/filesystem.hpp"
+namespace fs = boost::filesystem;
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+namespace output_staging
+{
+
+  // name next to output for a tree to delete (unique in the process)
+  static std::string trash_name(const std::string& output)
+  {
+    static std::atomic<uint32_t> count(0);
+    return output + ".trash-" + std::to_string(getpid()) + "-" + std::to_string(count++);
+  }
+
+  // swaps two paths in one step, if the kernel and filesystem can
+  static bool exchange(const std::string& a, const std::string& b)
+  {
+#ifdef SYS_renameat2
+    return syscall(SYS_renameat2, AT_FDCWD, a.c_str(), AT_FDCWD, b.c_str(),
+                   RENAME_EXCHANGE) == 0;
+#else
+    return false;
+#endif
+  }
+
+  remover::remover(bool verbose):_verbose(verbose),_stop(false),_held(false)
+  {
+  }
+
+  remover::~remover()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+      _cv.notify_all();
+    }
+    if(_thread.joinable())
+      _thread.join();
+    if(!_queue.empty())
+      std::cout << "Leaving " << _queue.size() << " old outputs to delete on the next run" << std::endl;
+  }
+
+  void remover::remove(const std::string& path)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    DEBUG("Deleting %s in the background\n", path.c_str());
+    _queue.push_back(path);
+    if(!_held && !_thread.joinable())
+      _thread = std::thread(&remover::worker, this);
+    _cv.notify_one();
+  }
+
+  void remover::hold()
+  {
+    // forked children only get the thread that forks, so a thread holding
+    // a lock (even malloc's) would leave it locked in them for good
+    std::lock_guard<std::mutex> lock(_mutex);
+    _held = true;
+  }
+
+  void remover::resume()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _held = false;
+    if(!_queue.empty() && !_thread.joinable())
+      _thread = std::thread(&remover::worker, this);
+  }
+
+  void remover::sweep(const std::string& output)
+  {
+    fs::path out(output);
+    fs::path parent = out.parent_path().empty() ? fs::path(".") : out.parent_path();
+    std::string trash = out.filename().string() + ".trash-";
+    std::string staging = out.filename().string() + ".staging-";
+
+    boost::system::error_code ec;
+    fs::directory_iterator it(parent, ec), end;
+    for(; !ec && it != end; it.increment(ec))
+    {
+      std::string name = it->path().filename().string();
+      if(name.compare(0, trash.size(), trash) == 0)
+      {
+        remove(it->path().string());
+      }
+      else if(name.compare(0, staging.size(), staging) == 0)
+      {
+        // only the staging dirs of runs that died, not of the ones running
+        pid_t pid = atoi(name.c_str() + staging.size());
+        if(pid > 0 && pid != getpid() && kill(pid, 0) != 0 && errno == ESRCH)
+          remove(it->path().string());
+      }
+    }
+  }
+
+  void remover::worker()
+  {
+    // out of the way of the conversion: lowest cpu priority and idle io
+    // class, for this thread only
+    pid_t tid = syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, 19);
+#ifdef SYS_ioprio_set
+    const int who_process = 1, class_idle = 3, class_shift = 13;
+    syscall(SYS_ioprio_set, who_process, tid, class_idle << class_shift);
+#endif
+
+    while(true)
+    {
+      std::string path;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while(_queue.empty() && !_stop)
+          _cv.wait(lock);
+        if(_stop)
+          return;
+        path = _queue.front();
+      }
+
+      if(!remove_tree(path))
+        return;
+      DEBUG("Deleted %s\n", path.c_str());
+
+      std::lock_guard<std::mutex> lock(_mutex);
+      _queue.pop_front();
+    }
+  }
+
+  bool remover::remove_tree(const std::string& path)
+  {
+    // depth first, one file at a time so a stop doesn't wait for the rest
+    boost::system::error_code ec;
+    if(fs::is_directory(fs::symlink_status(path, ec)))
+    {
+      fs::directory_iterator it(path, ec), end;
+      while(!ec && it != end)
+      {
+        if(_stop)
+          return false;
+        std::string entry = it->path().string();
+        it.increment(ec);
+        if(!remove_tree(entry))
+          return false;
+      }
+    }
+    fs::remove(path, ec);
+    if(ec)
+      DEBUG("Can't delete %s: %s\n", path.c_str(), ec.message().c_str());
+    return true;
+  }
+
+  staged_dir::staged_dir(const std::string& output, remover& trash, bool verbose):
+                         _output(output),_trash(trash),_verbose(verbose),_open(false)
+  {
+    // "out/" and "out" are the same output, and the staging dir goes next to it
+    while(_output.size() > 1 && _output[_output.size() - 1] == '/')
+      _output.erase(_output.size() - 1);
+    _staging = _output + ".staging-" + std::to_string(getpid());
+  }
+
+  staged_dir::~staged_dir()
+  {
+    if(!_open)
+      return;
+
+    // failed run, the output stays as it was
+    std::string trash = trash_name(_output);
+    boost::system::error_code ec;
+    fs::rename(_staging, trash, ec);
+    _trash.remove(ec ? _staging : trash);
+  }
+
+  int32_t staged_dir::open()
+  {
+    // leftovers of previous runs
+    _trash.sweep(_output);
+
+    boost::system::error_code ec;
+    if(fs::exists(fs::symlink_status(_staging, ec)))
+    {
+      std::string trash = trash_name(_output);
+      fs::rename(_staging, trash, ec);
+      if(ec)
+      {
+        std::cerr << "Can't move " << _staging << " out of the way: " << ec.message() << std::endl;
+        return STAGING_CANT_CREATE;
+      }
+      _trash.remove(trash);
+    }
+
+    if(!fs::create_directories(_staging, ec) || ec)
+    {
+      std::cerr << "Can't create " << _staging << ": " << ec.message() << std::endl;
+      return STAGING_CANT_CREATE;
+    }
+    DEBUG("Staging %s in %s\n", _output.c_str(), _staging.c_str());
+    _open = true;
+
+    return STAGING_OK;
+  }
+
+  int32_t staged_dir::commit()
+  {
+    if(!_open)
+      return STAGING_ERROR;
+
+    boost::system::error_code ec;
+    if(!fs::exists(fs::symlink_status(_output, ec)))
+    {
+      fs::rename(_staging, _output, ec);
+    }
+    else if(exchange(_staging, _output))
+    {
+      // the previous output is where the staging dir was
+      std::string trash = trash_name(_output);
+      fs::rename(_staging, trash, ec);
+      _trash.remove(ec ? _staging : trash);
+      ec.clear();
+    }
+    else
+    {
+      // no atomic swap: move the previous output aside first, and put it
+      // back if the new one can't take its place
+      std::string trash = trash_name(_output);
+      fs::rename(_output, trash, ec);
+      if(!ec)
+      {
+        fs::rename(_staging, _output, ec);
+        if(ec)
+        {
+          boost::system::error_code back;
+          fs::rename(trash, _output, back);
+        }
+        else
+        {
+          _trash.remove(trash);
+        }
+      }
+    }
+    if(ec)
+    {
+      std::cerr << "Can't move " << _staging << " to " << _output << ": " << ec.message() << std::endl;
+      return STAGING_CANT_SWAP;
+    }
+
+    DEBUG("Committed %s\n", _output.c_str());
+    _open = false;
+    return STAGING_OK;
+  }
+
+}
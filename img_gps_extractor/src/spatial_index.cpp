@@ -0,0 +1,360 @@
+/*
+ * Spatial index
+ *
+ * Grid index over the interpolated lat/long of every extracted image,
+ * persisted next to metadata.yaml so that radius, bounding box and nearest
+ * neighbour queries don't need to parse and scan the whole yaml.
+ *
+ */
+
+// class definitions
+#include "spatial_index.hpp"
+
+// basic stuff
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+// mmap the index
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace spatial_index
+{
+
+  static const char MAGIC[8] = "GPSIDX1";
+  static const double EARTH_RADIUS = 6371008.8; // mean radius in meters
+  static const double DEG_TO_RAD = M_PI / 180.0;
+  static const double METERS_PER_DEG = EARTH_RADIUS * DEG_TO_RAD;
+
+  double distance(double lat1, double lon1, double lat2, double lon2)
+  {
+    // haversine
+    double dlat = (lat2 - lat1) * DEG_TO_RAD;
+    double dlon = (lon2 - lon1) * DEG_TO_RAD;
+    double a = sin(dlat / 2) * sin(dlat / 2) +
+               cos(lat1 * DEG_TO_RAD) * cos(lat2 * DEG_TO_RAD) *
+               sin(dlon / 2) * sin(dlon / 2);
+    return 2 * EARTH_RADIUS * atan2(sqrt(a), sqrt(1 - a));
+  }
+
+  std::string image_name(uint32_t idx)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "%06u.jpg", idx);
+    return name;
+  }
+
+  static uint32_t cell_row(double lat, double cell_deg)
+  {
+    return static_cast<uint32_t>(floor((std::min(std::max(lat, -90.0), 90.0) + 90.0) / cell_deg));
+  }
+
+  static uint32_t cell_col(double lon, double cell_deg)
+  {
+    return static_cast<uint32_t>(floor((std::min(std::max(lon, -180.0), 180.0) + 180.0) / cell_deg));
+  }
+
+  static bool by_dist(const result_t& a, const result_t& b)
+  {
+    return a.dist < b.dist;
+  }
+
+  /*
+   * builder
+   */
+  builder::builder(double cell_deg):_cell_deg(cell_deg)
+  {
+  }
+
+  void builder::add(uint32_t idx, float lat, float lon)
+  {
+    // images without a position can't be indexed
+    if(!std::isfinite(lat) || !std::isfinite(lon))
+      return;
+    entry_t e;
+    e.lat = lat;
+    e.lon = lon;
+    e.idx = idx;
+    _entries.push_back(e);
+  }
+
+  size_t builder::size() const
+  {
+    return _entries.size();
+  }
+
+  int32_t builder::save(const std::string& path)
+  {
+    // group entries by cell, keeping image order inside each cell
+    const double cell_deg = _cell_deg;
+    std::stable_sort(_entries.begin(), _entries.end(),
+                     [cell_deg](const entry_t& a, const entry_t& b)
+                     {
+                       uint32_t ra = cell_row(a.lat, cell_deg), rb = cell_row(b.lat, cell_deg);
+                       if(ra != rb)
+                         return ra < rb;
+                       return cell_col(a.lon, cell_deg) < cell_col(b.lon, cell_deg);
+                     });
+
+    std::vector<cell_t> cells;
+    for(uint32_t i = 0; i < _entries.size(); i++)
+    {
+      uint32_t row = cell_row(_entries[i].lat, _cell_deg);
+      uint32_t col = cell_col(_entries[i].lon, _cell_deg);
+      if(cells.empty() || cells.back().row != row || cells.back().col != col)
+      {
+        cell_t c;
+        c.row = row;
+        c.col = col;
+        c.first = i;
+        c.count = 0;
+        cells.push_back(c);
+      }
+      cells.back().count++;
+    }
+
+    header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.cell_deg = _cell_deg;
+    header.n_cells = cells.size();
+    header.n_entries = _entries.size();
+
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!file.is_open())
+    {
+      std::cerr << "Can't create spatial index " << path << std::endl;
+      return INDEX_CANT_WRITE;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(cells.data()), cells.size() * sizeof(cell_t));
+    file.write(reinterpret_cast<const char*>(_entries.data()), _entries.size() * sizeof(entry_t));
+    file.close();
+    if(file.fail())
+    {
+      std::cerr << "Can't write spatial index " << path << std::endl;
+      return INDEX_CANT_WRITE;
+    }
+
+    return INDEX_OK;
+  }
+
+  /*
+   * index
+   */
+  index::index(bool verbose):_verbose(verbose),_map(NULL),_map_size(0),
+                             _header(NULL),_cells(NULL),_entries(NULL),
+                             _min_col(0),_max_col(0)
+  {
+  }
+
+  index::~index()
+  {
+    if(_map)
+      munmap(_map, _map_size);
+  }
+
+  size_t index::size() const
+  {
+    return _header ? _header->n_entries : 0;
+  }
+
+  int32_t index::load(const std::string& path)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+    {
+      std::cerr << "Can't open spatial index " << path << std::endl;
+      return INDEX_CANT_OPEN;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) || static_cast<size_t>(st.st_size) < sizeof(header_t))
+    {
+      close(fd);
+      std::cerr << "Invalid spatial index " << path << std::endl;
+      return INDEX_INVALID_FILE;
+    }
+
+    _map_size = st.st_size;
+    _map = mmap(NULL, _map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(_map == MAP_FAILED)
+    {
+      _map = NULL;
+      std::cerr << "Can't map spatial index " << path << std::endl;
+      return INDEX_CANT_OPEN;
+    }
+
+    _header = static_cast<const header_t*>(_map);
+    size_t expected = sizeof(header_t) + _header->n_cells * sizeof(cell_t) +
+                      _header->n_entries * sizeof(entry_t);
+    if(memcmp(_header->magic, MAGIC, sizeof(MAGIC)) || _map_size != expected ||
+       !(_header->cell_deg > 0))
+    {
+      std::cerr << "Invalid spatial index " << path << std::endl;
+      munmap(_map, _map_size);
+      _map = NULL;
+      _header = NULL;
+      return INDEX_INVALID_FILE;
+    }
+
+    _cells = reinterpret_cast<const cell_t*>(static_cast<const char*>(_map) + sizeof(header_t));
+    _entries = reinterpret_cast<const entry_t*>(_cells + _header->n_cells);
+
+    // column extent, to know when nearest neighbour searches can stop
+    _min_col = _max_col = _header->n_cells ? _cells[0].col : 0;
+    for(uint32_t i = 1; i < _header->n_cells; i++)
+    {
+      _min_col = std::min(_min_col, _cells[i].col);
+      _max_col = std::max(_max_col, _cells[i].col);
+    }
+    DEBUG("Loaded spatial index with %u images in %u cells of %f deg\n",
+          _header->n_entries, _header->n_cells, _header->cell_deg);
+
+    return INDEX_OK;
+  }
+
+  const cell_t* index::find_cell(uint32_t row, uint32_t col) const
+  {
+    return std::lower_bound(_cells, _cells + _header->n_cells, std::make_pair(row, col),
+                            [](const cell_t& c, const std::pair<uint32_t,uint32_t>& key)
+                            {
+                              return c.row < key.first ||
+                                     (c.row == key.first && c.col < key.second);
+                            });
+  }
+
+  void index::collect_rows(uint32_t row0, uint32_t row1, uint32_t col0, uint32_t col1,
+                           std::vector<result_t>& results) const
+  {
+    const cell_t *end = _cells + _header->n_cells;
+    for(uint32_t row = row0; row <= row1; row++)
+    {
+      for(const cell_t *c = find_cell(row, col0); c != end && c->row == row && c->col <= col1; c++)
+      {
+        for(uint32_t i = c->first; i < c->first + c->count; i++)
+        {
+          result_t r;
+          r.entry = _entries[i];
+          r.dist = 0;
+          results.push_back(r);
+        }
+      }
+    }
+  }
+
+  void index::bbox(double min_lat, double min_lon, double max_lat, double max_lon,
+                   std::vector<result_t>& results) const
+  {
+    results.clear();
+    if(!_header || !_header->n_cells || min_lat > max_lat || min_lon > max_lon)
+      return;
+
+    const double cell_deg = _header->cell_deg;
+    collect_rows(cell_row(min_lat, cell_deg), cell_row(max_lat, cell_deg),
+                 cell_col(min_lon, cell_deg), cell_col(max_lon, cell_deg), results);
+
+    // cells on the border are only partially inside
+    results.erase(std::remove_if(results.begin(), results.end(),
+                                 [&](const result_t& r)
+                                 {
+                                   return r.entry.lat < min_lat || r.entry.lat > max_lat ||
+                                          r.entry.lon < min_lon || r.entry.lon > max_lon;
+                                 }), results.end());
+  }
+
+  void index::radius(double lat, double lon, double meters,
+                     std::vector<result_t>& results) const
+  {
+    results.clear();
+    if(!_header || !_header->n_cells)
+      return;
+
+    // bounding box of the circle, then exact distance
+    double dlat = meters / METERS_PER_DEG;
+    double coslat = cos(std::min(fabs(lat) + dlat, 90.0) * DEG_TO_RAD);
+    double dlon = coslat > 1e-9 ? meters / (METERS_PER_DEG * coslat) : 360.0;
+    bbox(lat - dlat, lon - dlon, lat + dlat, lon + dlon, results);
+
+    for(auto& r:results)
+      r.dist = distance(lat, lon, r.entry.lat, r.entry.lon);
+    results.erase(std::remove_if(results.begin(), results.end(),
+                                 [meters](const result_t& r){ return r.dist > meters; }),
+                  results.end());
+    std::sort(results.begin(), results.end(), by_dist);
+  }
+
+  void index::nearest(double lat, double lon, uint32_t k,
+                      std::vector<result_t>& results) const
+  {
+    results.clear();
+    if(!_header || !_header->n_cells || !k)
+      return;
+
+    const double cell_deg = _header->cell_deg;
+    const int64_t crow = cell_row(lat, cell_deg);
+    const int64_t ccol = cell_col(lon, cell_deg);
+
+    // extent of the cells in the index, rings outside of it are empty
+    const int64_t min_row = _cells[0].row;
+    const int64_t max_row = _cells[_header->n_cells - 1].row;
+    const int64_t min_col = _min_col, max_col = _max_col;
+    int64_t first_ring = std::max(std::max(min_row - crow, crow - max_row),
+                                  std::max(min_col - ccol, ccol - max_col));
+    int64_t max_ring = std::max(std::max(crow - min_row, max_row - crow),
+                                std::max(ccol - min_col, max_col - ccol));
+
+    // search the cells in square rings around the query cell, until the k-th
+    // best candidate is closer than anything the next ring could contain
+    std::vector<result_t> ring;
+    for(int64_t r = std::max<int64_t>(first_ring, 0); r <= max_ring; r++)
+    {
+      ring.clear();
+      int64_t row0 = crow - r, row1 = crow + r;
+      int64_t col0 = std::max(ccol - r, min_col), col1 = std::min(ccol + r, max_col);
+      for(int64_t row = std::max(row0, min_row); row <= std::min(row1, max_row); row++)
+      {
+        if(row == row0 || row == row1)
+        {
+          collect_rows(row, row, col0, col1, ring); // full top/bottom row
+        }
+        else
+        {
+          if(ccol - r >= min_col)
+            collect_rows(row, row, ccol - r, ccol - r, ring);
+          if(ccol + r <= max_col)
+            collect_rows(row, row, ccol + r, ccol + r, ring);
+        }
+      }
+
+      for(auto& c:ring)
+      {
+        c.dist = distance(lat, lon, c.entry.lat, c.entry.lon);
+        results.push_back(c);
+      }
+      if(results.size() > k)
+      {
+        std::partial_sort(results.begin(), results.begin() + k, results.end(), by_dist);
+        results.resize(k);
+      }
+
+      // anything outside ring r is at least r cells away (lon degrees are the
+      // shortest ones, at the highest latitude the ring reaches)
+      double coslat = cos(std::min(fabs(lat) + (r + 1) * cell_deg, 90.0) * DEG_TO_RAD);
+      double bound = r * cell_deg * METERS_PER_DEG * coslat;
+      if(results.size() == k && !results.empty() &&
+         std::max_element(results.begin(), results.end(), by_dist)->dist <= bound)
+        break;
+    }
+
+    std::sort(results.begin(), results.end(), by_dist);
+  }
+
+}
@@ -0,0 +1,101 @@
+/*
+ * Timelapse writer
+ *
+ * Encodes the extracted frames into a single video from a background
+ * thread.
+ *
+ */
+
+// class definitions
+#include "timelapse_writer.hpp"
+
+// return codes
+#include "frame_decoder.hpp"
+
+namespace mp4_img_extractor
+{
+
+  timelapse_writer::timelapse_writer(bool verbose):_verbose(verbose),_frames(0),
+                                                   _ret(EXTR_OK)
+  {
+  }
+
+  timelapse_writer::~timelapse_writer()
+  {
+    close();
+  }
+
+  int32_t timelapse_writer::open(const std::string& path)
+  {
+    close();
+    _path = path;
+    _frames = 0;
+    _ret = EXTR_OK;
+    return EXTR_OK;
+  }
+
+  int32_t timelapse_writer::write(const cv::Mat& frame)
+  {
+    if(_path.empty() || frame.empty())
+      return EXTR_ERROR;
+
+    // create the video with the size of the first frame: h264 if opencv has
+    // an encoder for it, mpeg4 otherwise
+    if(!_writer.isOpened())
+    {
+      _size = frame.size();
+      const int codecs[] = {cv::VideoWriter::fourcc('a','v','c','1'),
+                            cv::VideoWriter::fourcc('m','p','4','v')};
+      for(int codec:codecs)
+      {
+        if(_writer.open(_path, codec, TIMELAPSE_FPS, _size))
+          break;
+      }
+      if(!_writer.isOpened())
+      {
+        std::cerr << "Can't create " << _path << std::endl;
+        _ret = EXTR_ERROR;
+        return _ret;
+      }
+      DEBUG("Writing timelapse %s at %dx%d\n",_path.c_str(),_size.width,_size.height);
+      _queue.reset(new pipeline::bounded_queue<cv::Mat>(TIMELAPSE_QUEUE));
+      _thread = std::thread(&timelapse_writer::worker, this);
+    }
+
+    // the caller reuses its frame, so the queue keeps a copy
+    if(!_queue->push(frame.clone()))
+      return EXTR_ERROR;
+    _frames++;
+
+    return _ret;
+  }
+
+  int32_t timelapse_writer::close()
+  {
+    if(_thread.joinable())
+    {
+      _queue->close();
+      _thread.join();
+    }
+    _queue.reset();
+    if(_writer.isOpened())
+    {
+      _writer.release();
+      DEBUG("Done writing timelapse %s, %u frames\n",_path.c_str(),_frames);
+    }
+    _path.clear();
+    return _ret;
+  }
+
+  void timelapse_writer::worker()
+  {
+    cv::Mat frame;
+    while(_queue->pop(frame))
+    {
+      if(frame.size() != _size)
+        cv::resize(frame, frame, _size, 0, 0, cv::INTER_AREA);
+      _writer.write(frame);
+    }
+  }
+
+}
@@ -0,0 +1,273 @@
+/*
+ * Watch folder
+ *
+ * Long running mode that watches a spool directory with inotify and
+ * converts every recording as soon as all of its chapters have landed and
+ * stopped changing.
+ *
+ */
+
+// class definitions
+#include "watch_folder.hpp"
+
+// basic stuff
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <iostream>
+
+// inotify
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+// boost filesystem to walk the tree
+#include "boost/filesystem.hpp"
+namespace fs = boost::filesystem;
+
+namespace watch_folder
+{
+
+  // set from signal handlers to finish the loop
+  static volatile sig_atomic_t _stop = 0;
+
+  // monotonic time in seconds
+  static double now()
+  {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+  }
+
+  watcher::watcher(const std::string& dir, float settle_time, bool verbose):
+                   _dir(dir),_settle_time(settle_time),_verbose(verbose),
+                   _fd(-1),_dirty(true)
+  {
+  }
+
+  watcher::~watcher()
+  {
+    if(_fd >= 0)
+      close(_fd);
+  }
+
+  void watcher::stop()
+  {
+    _stop = 1;
+  }
+
+  int32_t watcher::init()
+  {
+    if(!fs::is_directory(fs::path(_dir)))
+    {
+      std::cerr << "Watch dir " << _dir << " doesn't exist." << std::endl;
+      return WATCH_INPUT_NON_EXISTENT;
+    }
+
+    _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(_fd < 0)
+    {
+      std::cerr << "Can't init inotify: " << strerror(errno) << std::endl;
+      return WATCH_CANT_INIT_INOTIFY;
+    }
+
+    return add_watch(_dir);
+  }
+
+  int32_t watcher::add_watch(const std::string& dir)
+  {
+    const uint32_t mask = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE |
+                          IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+
+    int wd = inotify_add_watch(_fd, dir.c_str(), mask);
+    if(wd < 0)
+    {
+      std::cerr << "Can't watch " << dir << ": " << strerror(errno) << std::endl;
+      return WATCH_ERROR;
+    }
+    _watches[wd] = dir;
+    DEBUG("Watching %s\n", dir.c_str());
+
+    // subdirectories (cards are usually copied with their DCIM/100GOPRO tree)
+    boost::system::error_code ec;
+    for(fs::directory_iterator it(fs::path(dir), ec), end; !ec && it != end; it.increment(ec))
+    {
+      if(fs::is_directory(it->status()))
+        add_watch(it->path().string());
+    }
+
+    return WATCH_OK;
+  }
+
+  void watcher::read_events()
+  {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while(true)
+    {
+      ssize_t len = read(_fd, buf, sizeof(buf));
+      if(len <= 0)
+        break;
+
+      for(char *ptr = buf; ptr < buf + len; )
+      {
+        const struct inotify_event *ev = reinterpret_cast<const struct inotify_event*>(ptr);
+        ptr += sizeof(struct inotify_event) + ev->len;
+
+        if(ev->mask & IN_Q_OVERFLOW)
+        {
+          overflow();
+          continue;
+        }
+        if(ev->mask & IN_IGNORED)
+        {
+          _watches.erase(ev->wd);
+          continue;
+        }
+        auto w = _watches.find(ev->wd);
+        if(w == _watches.end() || ev->len == 0)
+          continue;
+
+        std::string path = w->second + "/" + ev->name;
+        _dirty = true;
+
+        if(ev->mask & IN_ISDIR)
+        {
+          if(ev->mask & (IN_CREATE | IN_MOVED_TO))
+            add_watch(path);
+        }
+        else if(ev->mask & (IN_CREATE | IN_MODIFY))
+        {
+          _writing.insert(path);
+        }
+        else
+        {
+          // closed after writing, moved in complete, or gone
+          _writing.erase(path);
+        }
+      }
+    }
+  }
+
+  void watcher::overflow()
+  {
+    // events were lost, so we can't know which files are still open: forget
+    // them and go by sizes, a session is complete when it stays the same for
+    // a whole settle time from now. Directories created in the meantime get
+    // their watches too.
+    std::cerr << "inotify queue overflowed, rescanning " << _dir << std::endl;
+    _writing.clear();
+    _dirty = true;
+    double t = now();
+    for(auto& st:_sessions)
+    {
+      if(!st.second.done)
+        st.second.last_change = t;
+    }
+    add_watch(_dir);
+  }
+
+  void watcher::scan()
+  {
+    _dirty = false;
+
+    std::vector<ingest::session_t> sessions;
+    if(ingest::discover_sessions(_dir, sessions, _verbose))
+      return;
+
+    double t = now();
+    for(auto& s:sessions)
+    {
+      std::vector<std::pair<std::string,uintmax_t> > signature;
+      for(auto& f:s.files)
+      {
+        boost::system::error_code ec;
+        uintmax_t size = fs::file_size(fs::path(f), ec);
+        signature.push_back(std::make_pair(f, ec ? 0 : size));
+      }
+
+      auto st = _sessions.find(s.name);
+      if(st == _sessions.end())
+      {
+        session_state_t state;
+        state.session = s;
+        state.signature = signature;
+        state.last_change = t;
+        state.done = false;
+        _sessions[s.name] = state;
+        std::cout << "New recording in spool: " << s.name << std::endl;
+      }
+      else if(st->second.signature != signature)
+      {
+        if(st->second.done)
+          std::cout << "Recording " << s.name << " changed after conversion. "
+                       "Converting again when complete." << std::endl;
+        st->second.session = s;
+        st->second.signature = signature;
+        st->second.last_change = t;
+        st->second.done = false;
+      }
+    }
+  }
+
+  int32_t watcher::run(const ingest::session_job& job)
+  {
+    std::cout << "Watching " << _dir << " for recordings (settle time "
+              << _settle_time << "s). Ctrl-C to exit." << std::endl;
+
+    while(!_stop)
+    {
+      struct pollfd pfd;
+      pfd.fd = _fd;
+      pfd.events = POLLIN;
+      int ret = poll(&pfd, 1, 1000);
+      if(ret < 0 && errno != EINTR)
+      {
+        std::cerr << "Error polling inotify: " << strerror(errno) << std::endl;
+        return WATCH_ERROR;
+      }
+      if(ret > 0)
+        read_events();
+      if(_dirty)
+        scan();
+
+      // convert every session that is complete: no chapter open for writing
+      // and no changes for a while
+      double t = now();
+      for(auto& st:_sessions)
+      {
+        if(_stop)
+          break;
+        session_state_t& s = st.second;
+        if(s.done || t - s.last_change < _settle_time)
+          continue;
+
+        bool writing = false;
+        for(auto& f:s.signature)
+          writing = writing || _writing.count(f.first);
+        if(writing)
+          continue;
+
+        std::cout << "Recording " << st.first << " is complete. Converting..." << std::endl;
+        if(job(s.session))
+          std::cerr << "Conversion of " << st.first << " failed." << std::endl;
+        else
+          std::cout << "Done converting " << st.first << "." << std::endl;
+
+        // don't retry until it changes again
+        s.done = true;
+
+        // pick up whatever landed while we were converting
+        read_events();
+        if(_dirty)
+          scan();
+        t = now();
+      }
+    }
+
+    std::cout << "Stopped watching " << _dir << std::endl;
+    return WATCH_OK;
+  }
+
+}
@@ -0,0 +1,180 @@
+/*
+ * YAML format
+ *
+ * Float to text in integer arithmetic, rounded like printf.
+ *
+ */
+
+// definitions
+#include "yaml_format.hpp"
+
+// basic stuff
+#include <stdio.h>
+#include <math.h>
+
+// precision of the emitter we have to match
+#include "yaml-cpp/yaml.h"
+
+namespace yaml_format
+{
+
+  static const uint64_t POW10[] = {1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull,
+                                   1000000ull, 10000000ull, 100000000ull,
+                                   1000000000ull, 10000000000ull, 100000000000ull,
+                                   1000000000000ull};
+
+  // the emitter doesn't expose it, so count the digits it writes for 1/3,
+  // whose expansion is longer than any precision
+  static int emitter_precision()
+  {
+    YAML::Emitter out;
+    out << 1.0f / 3.0f;
+    return static_cast<int>(out.size()) - 2; // "0."
+  }
+
+  static int float_precision()
+  {
+    static const int precision = emitter_precision();
+    return precision;
+  }
+
+  // |v| rounded to p significant digits (half to even on the exact value,
+  // like printf), and its decimal exponent. False if it doesn't fit the
+  // 64 bit arithmetic, which covers [1e-4, 1e9) for p <= 9.
+  static bool digits(float v, int p, uint64_t& q, int& e10)
+  {
+    float a = fabsf(v);
+    if(p < 1 || p > 9 || !(a >= 1e-4f && a < 1e9f))
+      return false;
+
+    // a = m * 2^e2, exactly
+    int exp2;
+    uint64_t m = static_cast<uint64_t>(ldexp(frexp(a, &exp2), 24));
+    int e2 = exp2 - 24;
+
+    // guess the decimal exponent from the binary one, and correct it with
+    // the integer part of the scaled value
+    e10 = static_cast<int>(floor((exp2 - 1) * 0.30102999566398120));
+    uint64_t rem = 0, half = 0;
+    for(int tries = 0; tries < 3; tries++)
+    {
+      int s = p - 1 - e10;
+      if(s < 0 || s > 12)
+        return false;
+
+      // q + rem/2^-e2 = a * 10^s
+      uint64_t n = m * POW10[s];
+      if(e2 >= 0)
+      {
+        q = n << e2;
+        rem = half = 0;
+      }
+      else
+      {
+        q = n >> -e2;
+        rem = n & ((1ull << -e2) - 1);
+        half = 1ull << (-e2 - 1);
+      }
+
+      if(q < POW10[p - 1])
+        e10--;
+      else if(q >= POW10[p])
+        e10++;
+      else
+        break;
+    }
+    if(q < POW10[p - 1] || q >= POW10[p])
+      return false;
+
+    if(rem > half || (half && rem == half && (q & 1)))
+      q++;
+    if(q == POW10[p])
+    {
+      q = POW10[p - 1];
+      e10++;
+    }
+    return true;
+  }
+
+  void append_float(std::string& out, float v)
+  {
+    if(isnan(v))
+    {
+      out += ".nan";
+      return;
+    }
+    if(isinf(v))
+    {
+      out += v < 0 ? "-.inf" : ".inf";
+      return;
+    }
+
+    int p = float_precision();
+    uint64_t q;
+    int e10;
+    if(!digits(v, p, q, e10))
+    {
+      char buf[64];
+      int n = snprintf(buf, sizeof(buf), "%.*g", p, static_cast<double>(v));
+      out.append(buf, n);
+      return;
+    }
+
+    // the p digits, without the trailing zeros %g drops
+    char d[16];
+    for(int i = p - 1; i >= 0; i--, q /= 10)
+      d[i] = '0' + q % 10;
+    int n = p;
+    while(n > 1 && d[n - 1] == '0')
+      n--;
+
+    if(v < 0)
+      out += '-';
+    if(e10 < -4 || e10 >= p)
+    {
+      // d.ddde+XX
+      out += d[0];
+      if(n > 1)
+      {
+        out += '.';
+        out.append(d + 1, n - 1);
+      }
+      out += e10 < 0 ? "e-" : "e+";
+      int x = e10 < 0 ? -e10 : e10;
+      if(x < 10)
+        out += '0';
+      append_uint(out, x);
+    }
+    else if(e10 >= 0)
+    {
+      // ddd.ddd
+      out.append(d, e10 + 1);
+      if(n > e10 + 1)
+      {
+        out += '.';
+        out.append(d + e10 + 1, n - e10 - 1);
+      }
+    }
+    else
+    {
+      // 0.000ddd
+      out += "0.";
+      out.append(-e10 - 1, '0');
+      out.append(d, n);
+    }
+  }
+
+  void append_uint(std::string& out, uint32_t v)
+  {
+    char buf[16];
+    int n = 0;
+    do
+    {
+      buf[n++] = '0' + v % 10;
+      v /= 10;
+    }while(v);
+    while(n)
+      out += buf[--n];
+  }
+
+}